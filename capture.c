@@ -0,0 +1,212 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "stcp.h"
+#include "capture.h"
+
+#define PCAP_MAGIC_NS 0xa1b23c4d        /* timestamps in nanoseconds */
+#define IP_HEADER 20
+
+typedef struct {
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    int32_t zone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} pcapFileHeader;
+
+typedef struct {
+    uint32_t sec;
+    uint32_t nsec;
+    uint32_t caplen;
+    uint32_t len;
+} pcapRecordHeader;
+
+int captureActive = 0;
+
+static int captureFd = -1;
+static unsigned char *buffer;           /* the one records are appended to */
+static int buffered;
+
+/*
+ * Full buffers go to the writer thread, so write() never runs on the
+ * thread that called dump(). Of the two buffers, the one not being
+ * filled is either spare, or pending or being written.
+ */
+static pthread_t writerThread;
+static pthread_mutex_t writerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writerWake = PTHREAD_COND_INITIALIZER;
+static unsigned char *spare;
+static unsigned char *pending;
+static int pendingLen;
+static int stopping;
+static struct sockaddr_in local;        /* the endpoints, in network byte order */
+static struct sockaddr_in remote;
+static unsigned short ipId;
+
+static void writeAll(unsigned char *p, int len) {
+    while (len > 0) {
+        ssize_t n = write(captureFd, p, len);
+        if (n <= 0) break;
+        p += n;
+        len -= n;
+    }
+}
+
+static void *writerMain(void *arg) {
+    pthread_mutex_lock(&writerLock);
+    for (;;) {
+        while (pending == NULL && !stopping) pthread_cond_wait(&writerWake, &writerLock);
+        if (pending == NULL) break;
+
+        unsigned char *p = pending;
+        int len = pendingLen;
+        pending = NULL;
+        pthread_mutex_unlock(&writerLock);
+        writeAll(p, len);
+        pthread_mutex_lock(&writerLock);
+        spare = p;
+        pthread_cond_broadcast(&writerWake);
+    }
+    pthread_mutex_unlock(&writerLock);
+    return NULL;
+}
+
+/*
+ * Hand the buffer to the writer thread and carry on with the spare one.
+ * This only waits if the writer is still busy with the previous buffer.
+ */
+static void flush(void) {
+    pthread_mutex_lock(&writerLock);
+    while (spare == NULL) pthread_cond_wait(&writerWake, &writerLock);
+    pending = buffer;
+    pendingLen = buffered;
+    buffer = spare;
+    spare = NULL;
+    pthread_cond_broadcast(&writerWake);
+    pthread_mutex_unlock(&writerLock);
+    buffered = 0;
+}
+
+/*
+ * Start capturing to fileName, replacing whatever it held. The capture
+ * is completed at exit if captureStop() is not called first.
+ * Returns 0, or -1 if the file cannot be created or a capture is on.
+ */
+int captureStart(const char *fileName) {
+    static int atexitDone = 0;
+    pcapFileHeader fh = { PCAP_MAGIC_NS, 2, 4, 0, 0, 65535, CAPTURE_LINKTYPE_RAW };
+
+    if (captureActive) return -1;
+    buffer = malloc(CAPTURE_BUFFER);
+    spare = malloc(CAPTURE_BUFFER);
+    pending = NULL;
+    stopping = 0;
+    captureFd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int started = buffer != NULL && spare != NULL && captureFd >= 0 &&
+                  (errno = pthread_create(&writerThread, NULL, writerMain, NULL)) == 0;
+    if (!started) {
+        logPerror((char *) fileName);
+        free(buffer);
+        free(spare);
+        buffer = spare = NULL;
+        if (captureFd >= 0) close(captureFd);
+        captureFd = -1;
+        return -1;
+    }
+
+    memcpy(buffer, &fh, sizeof(fh));
+    buffered = sizeof(fh);
+    local.sin_addr.s_addr = remote.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    local.sin_port = remote.sin_port = 0;
+    if (!atexitDone) atexit(captureStop);
+    atexitDone = 1;
+    captureActive = 1;
+    return 0;
+}
+
+/*
+ * Stop capturing: hand over what is buffered and wait for the writer
+ * thread to finish the file.
+ */
+void captureStop(void) {
+    if (!captureActive) return;
+    captureActive = 0;
+    flush();
+    pthread_mutex_lock(&writerLock);
+    stopping = 1;
+    pthread_cond_broadcast(&writerWake);
+    pthread_mutex_unlock(&writerLock);
+    pthread_join(writerThread, NULL);
+
+    close(captureFd);
+    captureFd = -1;
+    free(buffer);
+    free(spare);
+    buffer = spare = NULL;
+}
+
+/*
+ * Take the addresses and ports of the packets to come from fd, a
+ * connected UDP socket.
+ */
+void captureEndpoints(int fd) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+
+    if (getsockname(fd, (struct sockaddr *) &sin, &len) == 0 && sin.sin_family == AF_INET) local = sin;
+    len = sizeof(sin);
+    if (getpeername(fd, (struct sockaddr *) &sin, &len) == 0 && sin.sin_family == AF_INET) remote = sin;
+}
+
+/*
+ * Append one segment of len bytes to the capture. hdr is its header in
+ * host byte order, followed by any options; dir is 's'ent or 'r'eceived.
+ */
+void capturePacket(char dir, tcpheader *hdr, int len) {
+    int hdrLen = tcpHeaderLength(hdr, len);
+    int caplen = IP_HEADER + hdrLen;
+    struct sockaddr_in *src = dir == 's' ? &local : &remote;
+    struct sockaddr_in *dst = dir == 's' ? &remote : &local;
+    struct timespec ts;
+
+    if (buffered + (int) sizeof(pcapRecordHeader) + caplen > CAPTURE_BUFFER) flush();
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    pcapRecordHeader rh = { ts.tv_sec, ts.tv_nsec, caplen, IP_HEADER + len };
+    memcpy(buffer + buffered, &rh, sizeof(rh));
+    unsigned char *ip = buffer + buffered + sizeof(rh);
+
+    /* IPv4: no options, don't fragment, TTL 64, TCP */
+    unsigned short totalLen = min(IP_HEADER + len, 65535);
+    memset(ip, 0, IP_HEADER);
+    ip[0] = 0x45;
+    *(uint16_t *) (ip + 2) = htons(totalLen);
+    *(uint16_t *) (ip + 4) = htons(ipId++);
+    *(uint16_t *) (ip + 6) = htons(0x4000);
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    memcpy(ip + 12, &src->sin_addr, 4);
+    memcpy(ip + 16, &dst->sin_addr, 4);
+    *(uint16_t *) (ip + 10) = ipchecksum(ip, IP_HEADER);
+
+    /* TCP keeps dataOffset in the top nibble, and the ports are the UDP ones */
+    tcpheader *tcp = (tcpheader *) (ip + IP_HEADER);
+    memcpy(tcp, hdr, hdrLen);
+    htonHdr(tcp);
+    tcp->srcPort = src->sin_port;
+    tcp->dstPort = dst->sin_port;
+    tcp->dataOffset = (hdrLen / 4) << 4;
+
+    buffered += sizeof(rh) + caplen;
+}
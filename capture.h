@@ -0,0 +1,29 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+#include "tcp.h"
+
+/*
+ * Packet capture to a pcap file that Wireshark and tcpdump can read.
+ * Every segment dump() sees is written as an IPv4 packet between the
+ * UDP socket's two endpoints. The STCP header is laid out like a TCP
+ * header, so it is labelled TCP: Wireshark then follows sequence
+ * numbers, windows, SACK blocks and retransmissions as it would for
+ * TCP. Only the headers and options are captured, while the lengths
+ * cover the payload too.
+ *
+ * Records collect in a buffer. Whenever it fills, and at captureStop(),
+ * it is handed to a writer thread and a second buffer takes its place,
+ * so the thread that calls dump() never writes to the file itself.
+ */
+
+#define CAPTURE_BUFFER (256 * 1024)
+#define CAPTURE_LINKTYPE_RAW 101        /* each packet starts with its IP header */
+
+extern int captureActive;
+
+extern int captureStart(const char *fileName);
+extern void captureStop(void);
+extern void captureEndpoints(int fd);
+extern void capturePacket(char dir, tcpheader *hdr, int len);
+
+#endif
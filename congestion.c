@@ -0,0 +1,144 @@
+/*
+ * Congestion control algorithms for the STCP sender: NewReno (RFC 5681,
+ * RFC 6582) and CUBIC (RFC 9438).
+ */
+
+#include <math.h>
+#include <string.h>
+#include "congestion.h"
+
+#define CUBIC_C    0.4              /* scales the cubic, in segments per second cubed */
+#define CUBIC_BETA 0.7              /* multiplicative decrease */
+
+static unsigned int umax(unsigned int a, unsigned int b) { return a > b ? a : b; }
+static unsigned int umin(unsigned int a, unsigned int b) { return a < b ? a : b; }
+
+/* The initial window of RFC 6928 */
+static unsigned int initialWindow(int mss) {
+    return umin(10 * mss, umax(2 * mss, 14600));
+}
+
+/*
+ * Slow start: grow cwnd by every byte acked, up to ssthresh. Returns the
+ * acked bytes left over for congestion avoidance.
+ */
+static unsigned int slowStart(ccState *cc, unsigned int acked) {
+    unsigned int grow = umin(acked, cc->ssthresh - cc->cwnd);
+    cc->cwnd += grow;
+    return acked - grow;
+}
+
+static void renoInit(ccState *cc, int mss) {
+    memset(cc, 0, sizeof(*cc));
+    cc->mss = mss;
+    cc->cwnd = initialWindow(mss);
+    cc->ssthresh = CC_INFINITE_SSTHRESH;
+}
+
+/*
+ * Congestion avoidance grows cwnd by one segment for every cwnd bytes
+ * acked, i.e. once per round trip.
+ */
+static void renoOnAck(ccState *cc, unsigned int acked, long now) {
+    if (cc->cwnd < cc->ssthresh) acked = slowStart(cc, acked);
+
+    cc->ackedBytes += acked;
+    while (cc->ackedBytes >= cc->cwnd) {
+        cc->ackedBytes -= cc->cwnd;
+        cc->cwnd += cc->mss;
+    }
+}
+
+static void renoOnLoss(ccState *cc, unsigned int inFlight, long now) {
+    cc->ssthresh = umax(inFlight / 2, 2 * cc->mss);
+    cc->cwnd = cc->ssthresh;
+    cc->ackedBytes = 0;
+}
+
+static void renoOnTimeout(ccState *cc, unsigned int inFlight, int first, long now) {
+    if (first) cc->ssthresh = umax(inFlight / 2, 2 * cc->mss);
+    cc->cwnd = cc->mss;
+    cc->ackedBytes = 0;
+}
+
+const ccOps ccNewReno = { "newreno", renoInit, renoOnAck, renoOnLoss, renoOnTimeout };
+
+/*
+ * After a reduction CUBIC grows cwnd along W(t) = C (t - K)^3 + wMax,
+ * flattening out as it gets back to the window where the loss happened
+ * and probing faster beyond it. It never grows slower than Reno would.
+ */
+static void cubicOnAck(ccState *cc, unsigned int acked, long now) {
+    if (cc->cwnd < cc->ssthresh) {
+        acked = slowStart(cc, acked);
+        if (acked == 0) return;
+    }
+
+    double cwnd = (double) cc->cwnd / cc->mss;
+    double segments = (double) acked / cc->mss;
+
+    if (cc->epochStart == 0) {
+        cc->epochStart = now;
+        if (cwnd < cc->wMax) {
+            cc->k = cbrt((cc->wMax - cwnd) / CUBIC_C);
+        } else {
+            cc->k = 0;
+            cc->wMax = cwnd;
+        }
+        cc->wEst = cwnd;
+    }
+
+    double t = (now - cc->epochStart) / 1000.0 - cc->k;
+    double target = cc->wMax + CUBIC_C * t * t * t;
+
+    cc->wEst += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * segments / cwnd;
+    if (target < cc->wEst) target = cc->wEst;
+    if (target > 1.5 * cwnd) target = 1.5 * cwnd;
+    if (target <= cwnd) return;
+
+    cc->growth += (target - cwnd) / cwnd * acked;
+    if (cc->growth >= 1) {
+        cc->cwnd += (unsigned int) cc->growth;
+        cc->growth -= (unsigned int) cc->growth;
+    }
+}
+
+/*
+ * Remember where the loss happened and cut cwnd by CUBIC_BETA. If the
+ * loss came before cwnd got back to the previous wMax, competing flows
+ * are probably taking bandwidth, so settle below it to let them
+ * (fast convergence).
+ */
+static void cubicReduce(ccState *cc) {
+    double cwnd = (double) cc->cwnd / cc->mss;
+
+    cc->wMax = cwnd < cc->wMax ? cwnd * (1 + CUBIC_BETA) / 2 : cwnd;
+    cc->ssthresh = umax(cc->cwnd * CUBIC_BETA, 2 * cc->mss);
+    cc->epochStart = 0;
+    cc->growth = 0;
+}
+
+static void cubicOnLoss(ccState *cc, unsigned int inFlight, long now) {
+    cubicReduce(cc);
+    cc->cwnd = cc->ssthresh;
+}
+
+static void cubicOnTimeout(ccState *cc, unsigned int inFlight, int first, long now) {
+    if (first) cubicReduce(cc);
+    cc->cwnd = cc->mss;
+    cc->epochStart = 0;
+}
+
+const ccOps ccCubic = { "cubic", renoInit, cubicOnAck, cubicOnLoss, cubicOnTimeout };
+
+/*
+ * Find an algorithm by name. Returns NULL if there is none by that name.
+ */
+const ccOps *ccLookup(const char *name) {
+    static const ccOps *algorithms[] = { &ccNewReno, &ccCubic };
+
+    for (int i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+        if (strcmp(algorithms[i]->name, name) == 0) return algorithms[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef __CONGESTION_H__
+#define __CONGESTION_H__
+
+/*
+ * Congestion control for the STCP sender. The sender keeps a ccState in
+ * its control block and reports events to the ccOps of the algorithm
+ * the connection uses; the algorithm only adjusts cwnd and ssthresh.
+ * The sender never has more than min(cwnd, receiver's window) bytes in
+ * flight.
+ *
+ * All windows are in bytes and all times in milliseconds.
+ */
+
+#define CC_INFINITE_SSTHRESH 0x7fffffff
+
+typedef struct ccState {
+    unsigned int cwnd;
+    unsigned int ssthresh;
+    int mss;
+    unsigned int ackedBytes;        /* acked since cwnd last grew in congestion avoidance */
+
+    /* CUBIC */
+    long epochStart;                /* start of the current growth epoch, 0 if none */
+    double wMax;                    /* cwnd before the last reduction, in segments */
+    double k;                       /* seconds from epochStart until cwnd is back at wMax */
+    double wEst;                    /* what Reno would have grown cwnd to, in segments */
+    double growth;                  /* bytes of growth not yet added to cwnd */
+} ccState;
+
+typedef struct ccOps {
+    const char *name;
+    void (*init)(ccState *cc, int mss);
+    /* acked bytes were newly acknowledged, other than during fast recovery */
+    void (*onAck)(ccState *cc, unsigned int acked, long now);
+    /* duplicate ACKs started a fast retransmission */
+    void (*onLoss)(ccState *cc, unsigned int inFlight, long now);
+    /* the retransmission timer expired; first is 0 if it already had since the last ACK */
+    void (*onTimeout)(ccState *cc, unsigned int inFlight, int first, long now);
+} ccOps;
+
+extern const ccOps ccNewReno;
+extern const ccOps ccCubic;
+
+extern const ccOps *ccLookup(const char *name);
+#endif
@@ -0,0 +1,67 @@
+#include <string.h>
+#include "log.h"
+#include "histogram.h"
+
+static int bucketOf(uint64_t value) {
+    if (value < HIST_SUB) return value;
+
+    int magnitude = 63 - __builtin_clzll(value);
+    if (magnitude >= HIST_MAGNITUDES) return HIST_BUCKETS - 1;
+    int shift = magnitude - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int) ((value >> shift) - HIST_SUB);
+}
+
+/* The largest value that lands in a bucket */
+static uint64_t bucketTop(int bucket) {
+    if (bucket < HIST_SUB) return bucket;
+    if (bucket == HIST_BUCKETS - 1) return UINT64_MAX;      /* and everything larger */
+
+    int shift = bucket / HIST_SUB - 1;
+    uint64_t low = (uint64_t) (HIST_SUB + bucket % HIST_SUB) << shift;
+    return low + ((uint64_t) 1 << shift) - 1;
+}
+
+void histInit(histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void histRecord(histogram *h, uint64_t value) {
+    h->counts[bucketOf(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+}
+
+/*
+ * The value that percent of the samples are at or below, to within the
+ * precision of a bucket. Returns 0 for an empty histogram.
+ */
+uint64_t histPercentile(histogram *h, double percent) {
+    uint64_t target = (uint64_t) (percent / 100 * h->count + 0.5);
+    uint64_t seen = 0;
+
+    if (h->count == 0) return 0;
+    if (target == 0) target = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) return bucketTop(i) < h->max ? bucketTop(i) : h->max;
+    }
+    return h->max;
+}
+
+/*
+ * Summarize a histogram of nanoseconds on the stats channel, in
+ * microseconds.
+ */
+void histLog(histogram *h, const char *name) {
+    if (h->count == 0) {
+        logLog("stats", "%s: no samples", name);
+        return;
+    }
+    logLog("stats", "%s: %llu samples, us min %.3f mean %.3f p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f",
+           name, (unsigned long long) h->count, h->min / 1000.0, (double) h->sum / h->count / 1000.0,
+           histPercentile(h, 50) / 1000.0, histPercentile(h, 90) / 1000.0, histPercentile(h, 99) / 1000.0,
+           histPercentile(h, 99.9) / 1000.0, h->max / 1000.0);
+}
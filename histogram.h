@@ -0,0 +1,50 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+#include <stdint.h>
+
+/*
+ * Latency histograms in the style of HdrHistogram. Values (in ns) up to
+ * HIST_SUB are counted exactly; above that every power of two is split
+ * into HIST_SUB linear buckets, so a bucket is never wider than about
+ * 3% of the values in it, however large, and recording is a couple of
+ * shifts and an increment.
+ *
+ * The histStamp(), histMark(), histElapsed(), histSince() and histAdd()
+ * macros only do anything when built with -DSTCP_HISTOGRAMS; otherwise
+ * they and their arguments compile to nothing, so the fields they name
+ * can be declared under the same #ifdef.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAGNITUDES 40                      /* values up to 2^40 ns, about 18 minutes */
+#define HIST_BUCKETS ((HIST_MAGNITUDES - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} histogram;
+
+extern void histInit(histogram *h);
+extern void histRecord(histogram *h, uint64_t value);
+extern uint64_t histPercentile(histogram *h, double percent);
+extern void histLog(histogram *h, const char *name);
+
+#ifdef STCP_HISTOGRAMS
+#define histStamp(t) uint64_t t = nowNs()
+#define histMark(var) ((var) = nowNs())
+#define histElapsed(var, t) ((var) = nowNs() - (t))
+#define histSince(h, t) histRecord(h, nowNs() - (t))
+#define histAdd(h, value) histRecord(h, value)
+#else
+#define histStamp(t) do { } while (0)
+#define histMark(var) do { } while (0)
+#define histElapsed(var, t) do { } while (0)
+#define histSince(h, t) do { } while (0)
+#define histAdd(h, value) do { } while (0)
+#endif
+
+#endif
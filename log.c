@@ -2,34 +2,30 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include "log.h"
 
-static char **enabledChannels = NULL;
-static char *prefix;
+unsigned long long logMask = 0;
+static const char *channelNames[LOG_MAX_CHANNELS - 1];
+static int channelCount = 0;
+static pthread_mutex_t channelLock = PTHREAD_MUTEX_INITIALIZER;
+static char *prefix = "";
 
-static int enabled(char *channel) {
-    for (int i = 0; enabledChannels[i]; i++) {
-	char *c = enabledChannels[i];
-	if (!strcmp(c, channel)) return 1;
-    }
-    return 0;
+/*
+ * Nanoseconds on the monotonic clock, which does not jump when the
+ * wall clock is set. clock_gettime() on it is served from the vDSO
+ * without entering the kernel.
+ */
+uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
+/* Milliseconds on the same clock as nowNs() */
 long now() {
-    struct timeval t;
-    long ans;
-    gettimeofday(&t, NULL);
-    ans = t.tv_sec * 1000 + t.tv_usec / 1000;
-    return ans;
-}
-
-static int countOccurances(char *s, char c) {
-    int count = 0;
-    while (*s) {
-	if (*s == c) count++;
-	s++;
-    }
-    return count;
+    return nowNs() / 1000000;
 }
 
 static char *strsave(char *s) {
@@ -45,6 +41,38 @@ static char *strnsave(char *s, int len) {
     return ans;
 }
 
+/*
+ * The bit that stands for channel, given to it now if it has none yet.
+ * Call sites remember the answer, so this is rare enough to lock.
+ */
+int logChannel(const char *channel) {
+    int bit = LOG_MAX_CHANNELS - 1;
+
+    pthread_mutex_lock(&channelLock);
+    for (int i = 0; i < channelCount; i++) {
+	if (!strcmp(channelNames[i], channel)) {
+	    bit = i;
+	    break;
+	}
+    }
+    if (bit == LOG_MAX_CHANNELS - 1 && channelCount < LOG_MAX_CHANNELS - 1) {
+	channelNames[channelCount] = strsave((char *) channel);
+	bit = channelCount++;
+    }
+    pthread_mutex_unlock(&channelLock);
+    return bit;
+}
+
+/*
+ * The name of the channel with the given bit, or NULL if none has it.
+ */
+const char *logChannelName(int bit) {
+    pthread_mutex_lock(&channelLock);
+    const char *name = bit >= 0 && bit < channelCount ? channelNames[bit] : NULL;
+    pthread_mutex_unlock(&channelLock);
+    return name;
+}
+
 /*
  * prefixx is an arbitrary string that will be displayed at the beginning of
  * each logged message. 
@@ -55,36 +83,39 @@ static char *strnsave(char *s, int len) {
  * names will not be displayed.
  */
 void logConfig(char *prefixx, char *channels) {
+    unsigned long long mask = 0;
+
     prefix = strsave(prefixx);
-    int len = countOccurances(channels, ',') + 1;
-    enabledChannels = calloc(len + 1, sizeof(char *));
-    int i = 0;
     while (*channels) {
 	char *pos = index(channels, ',');
-	if (pos == NULL) {
-	    len = strlen(channels);
-	} else {
-	    len = pos - channels;
-	}
+	int len = pos == NULL ? strlen(channels) : pos - channels;
 	char *one = strnsave(channels, len);
-	enabledChannels[i] = one;
-	i++;
+	int bit = logChannel(one);
+	if (bit < LOG_MAX_CHANNELS - 1) mask |= 1ULL << bit;
+	free(one);
 	channels += len + (pos == NULL ? 0 : 1);
     }
-    enabledChannels[i] = NULL;
+
+    /* Other threads test the mask while it may change, so it is published whole */
+    __atomic_store_n(&logMask, mask, __ATOMIC_RELAXED);
 }
 
-void logLog(char *channel, char *format, ...) {
+/*
+ * Print one message. logLog has already checked that its channel is on.
+ * stdout stays locked for the whole line, so messages from different
+ * threads never interleave.
+ */
+void logWrite(const char *channel, const char *format, ...) {
     va_list al;
+    long t = now() % 100000000;
 
-    if (enabled(channel)) {
-	long t = now() % 100000000;
-	printf("%4ld.%03ld %s: (%s) ", t / 1000, t % 1000, prefix, channel);
-	va_start(al, format);
-	vprintf(format, al);
-	va_end(al);
-	putchar('\n');
-    }
+    flockfile(stdout);
+    printf("%4ld.%03ld %s: (%s) ", t / 1000, t % 1000, prefix, channel);
+    va_start(al, format);
+    vprintf(format, al);
+    va_end(al);
+    putchar_unlocked('\n');
+    funlockfile(stdout);
 }
 
 void logPerror(char *who) {
@@ -1,5 +1,6 @@
 #ifndef __LOG_H__
 #define __LOG_H__
+#include <stdint.h>
 #include <sys/time.h>
 #include <sys/errno.h>
 
@@ -8,12 +9,45 @@
  * argument to logConfig and then using them in calls to logLog.  
  * 
  * See sender.c for examples.
+ *
+ * Each channel name is given a bit the first time it is seen, and
+ * logConfig sets the bits of the enabled ones in logMask. logLog is a
+ * macro that remembers its channel's bit at each call site and tests it
+ * before anything else, so a message on a disabled channel costs one
+ * branch: its arguments are never evaluated. Building with -DLOG_STRIP
+ * compiles every message away.
+ *
+ * Any thread may log, so logMask and the bit cached at each call site
+ * are read and written with relaxed atomic accesses.
  */
 
+#define LOG_MAX_CHANNELS 64     /* the last bit is shared by any channels beyond, and never set */
+
+extern unsigned long long logMask;
+
 extern void logConfig(char *name, char *channels);
-extern void logLog(char *channel, char *format, ...);
+extern int logChannel(const char *channel);
+extern const char *logChannelName(int bit);
+extern void logWrite(const char *channel, const char *format, ...) __attribute__((format(printf, 2, 3)));
 extern void logPerror(char *who);
 extern long now();
+extern uint64_t nowNs(void);
+
+#ifdef LOG_STRIP
+#define logOn(channel) 0
+#else
+#define logOn(channel) __extension__ ({                       \
+        static int logId_ = -1;                               \
+        int id_ = __atomic_load_n(&logId_, __ATOMIC_RELAXED); \
+        if (id_ < 0) {                                        \
+            id_ = logChannel(channel);                        \
+            __atomic_store_n(&logId_, id_, __ATOMIC_RELAXED); \
+        }                                                     \
+        (int) ((__atomic_load_n(&logMask, __ATOMIC_RELAXED) >> id_) & 1); })
+#endif
 
+#define logLog(channel, ...) do {                       \
+        if (logOn(channel)) logWrite(channel, __VA_ARGS__); \
+    } while (0)
 
 #endif
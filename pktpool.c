@@ -0,0 +1,74 @@
+/*
+ * Slab-backed free list of fixed-size packet buffers.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pktpool.h"
+
+/*
+ * Add one slab of POOL_SLAB_BLOCKS buffers to the free list. The slab
+ * header takes the first cache line so every buffer stays aligned.
+ */
+static int poolGrow(pktPool *pool) {
+    size_t size = POOL_ALIGN + pool->blockSize * POOL_SLAB_BLOCKS;
+    poolSlab *slab = aligned_alloc(POOL_ALIGN, size);
+    if (slab == NULL) return -1;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    unsigned char *block = (unsigned char *) slab + POOL_ALIGN;
+    for (int i = 0; i < POOL_SLAB_BLOCKS; i++, block += pool->blockSize) {
+        *(void **) block = pool->freeList;
+        pool->freeList = block;
+    }
+    pool->capacity += POOL_SLAB_BLOCKS;
+    return 0;
+}
+
+/*
+ * Prepare a pool of buffers of at least size bytes and allocate its
+ * first slab. Returns 0 on success or -1 if out of memory.
+ */
+int poolInit(pktPool *pool, size_t size) {
+    memset(pool, 0, sizeof(*pool));
+    if (size < sizeof(void *)) size = sizeof(void *);
+    pool->blockSize = (size + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+    return poolGrow(pool);
+}
+
+/*
+ * Return a buffer, or NULL if the pool is empty and cannot grow. Its
+ * contents are left as they were, so the caller initializes what it
+ * uses.
+ */
+void *poolAlloc(pktPool *pool) {
+    if (pool->freeList == NULL && poolGrow(pool) < 0) return NULL;
+
+    void *block = pool->freeList;
+    pool->freeList = *(void **) block;
+    pool->inUse++;
+    return block;
+}
+
+void poolFree(pktPool *pool, void *block) {
+    if (block == NULL) return;
+    *(void **) block = pool->freeList;
+    pool->freeList = block;
+    pool->inUse--;
+}
+
+/*
+ * Release every slab. Buffers still allocated from the pool become
+ * invalid.
+ */
+void poolDestroy(pktPool *pool) {
+    poolSlab *slab = pool->slabs;
+    while (slab) {
+        poolSlab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    memset(pool, 0, sizeof(*pool));
+}
@@ -0,0 +1,32 @@
+#ifndef __PKTPOOL_H__
+#define __PKTPOOL_H__
+#include <stddef.h>
+
+/*
+ * A pool of fixed-size, cache-line aligned packet buffers. Buffers are
+ * carved out of slabs and recycled through a free list, so once the pool
+ * has grown to the connection's working set, allocating and freeing a
+ * packet never calls malloc. A pool belongs to one connection and is not
+ * thread safe.
+ */
+
+#define POOL_ALIGN 64               /* cache line size */
+#define POOL_SLAB_BLOCKS 256        /* buffers added each time the pool grows */
+
+typedef struct poolSlab {
+    struct poolSlab *next;
+} poolSlab;
+
+typedef struct {
+    void *freeList;
+    poolSlab *slabs;
+    size_t blockSize;               /* requested size rounded up to POOL_ALIGN */
+    int inUse;
+    int capacity;
+} pktPool;
+
+extern int poolInit(pktPool *pool, size_t size);
+extern void *poolAlloc(pktPool *pool);
+extern void poolFree(pktPool *pool, void *block);
+extern void poolDestroy(pktPool *pool);
+#endif
@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+#include "reassembly.h"
+#include "wraparound.h"
+
+#define WORD_BITS 64
+
+/* Set or clear n bits from bit from, which must not run past the end */
+static void bitsSet(unsigned long long *bits, unsigned int from, unsigned int n, int on) {
+    while (n > 0) {
+        unsigned int bit = from % WORD_BITS;
+        unsigned int chunk = WORD_BITS - bit < n ? WORD_BITS - bit : n;
+        unsigned long long mask = (chunk == WORD_BITS ? ~0ULL : (1ULL << chunk) - 1) << bit;
+
+        if (on) bits[from / WORD_BITS] |= mask;
+        else bits[from / WORD_BITS] &= ~mask;
+        from += chunk;
+        n -= chunk;
+    }
+}
+
+/* How many of n bits from bit from are set */
+static unsigned int bitsCount(unsigned long long *bits, unsigned int from, unsigned int n) {
+    unsigned int count = 0;
+
+    while (n > 0) {
+        unsigned int bit = from % WORD_BITS;
+        unsigned int chunk = WORD_BITS - bit < n ? WORD_BITS - bit : n;
+        unsigned long long mask = (chunk == WORD_BITS ? ~0ULL : (1ULL << chunk) - 1) << bit;
+
+        count += __builtin_popcountll(bits[from / WORD_BITS] & mask);
+        from += chunk;
+        n -= chunk;
+    }
+    return count;
+}
+
+/*
+ * How many bits in a row from bit from on are set (or clear, if set is
+ * 0), looking at no more than n
+ */
+static unsigned int bitsRun(unsigned long long *bits, unsigned int from, unsigned int n, int set) {
+    unsigned int run = 0;
+
+    while (n > 0) {
+        unsigned int bit = from % WORD_BITS;
+        unsigned int chunk = WORD_BITS - bit < n ? WORD_BITS - bit : n;
+        unsigned long long word = bits[from / WORD_BITS] >> bit;
+        unsigned long long stop = set ? ~word : word;
+        unsigned int ones = stop ? __builtin_ctzll(stop) : WORD_BITS;
+
+        if (ones < chunk) return run + ones;
+        run += chunk;
+        from += chunk;
+        n -= chunk;
+    }
+    return run;
+}
+
+/*
+ * Like bitsRun(), from the ring position of seq and wrapping round the
+ * end of the ring.
+ */
+static unsigned int ringRun(reasmBuffer *ra, unsigned int seq, unsigned int n, int set) {
+    unsigned int pos = seq & (ra->size - 1);
+    unsigned int first = ra->size - pos < n ? ra->size - pos : n;
+    unsigned int run = bitsRun(ra->bits, pos, first, set);
+
+    if (run == first) run += bitsRun(ra->bits, 0, n - first, set);
+    return run;
+}
+
+/*
+ * Apply bitsSet() to n bits from the ring position of seq, wrapping
+ * round the end of the ring.
+ */
+static void ringBits(reasmBuffer *ra, unsigned int seq, unsigned int n, int on) {
+    unsigned int pos = seq & (ra->size - 1);
+    unsigned int first = ra->size - pos < n ? ra->size - pos : n;
+
+    bitsSet(ra->bits, pos, first, on);
+    bitsSet(ra->bits, 0, n - first, on);
+}
+
+/*
+ * Make room for size bytes, rounded up to a power of two, with start
+ * the first sequence number expected.
+ * Returns 0, or -1 if out of memory.
+ */
+int reasmInit(reasmBuffer *ra, unsigned int size, unsigned int start) {
+    unsigned int ringSize = WORD_BITS;
+
+    while (ringSize < size) ringSize *= 2;
+    ra->size = ringSize;
+    ra->start = ra->end = start;
+    ra->data = malloc(ringSize);
+    ra->bits = calloc(ringSize / WORD_BITS, sizeof(unsigned long long));
+    if (ra->data == NULL || ra->bits == NULL) {
+        reasmFree(ra);
+        return -1;
+    }
+    return 0;
+}
+
+void reasmFree(reasmBuffer *ra) {
+    free(ra->data);
+    free(ra->bits);
+    ra->data = NULL;
+    ra->bits = NULL;
+}
+
+/*
+ * Store len bytes that start at sequence number seq. Bytes before start
+ * have been drained already and are ignored, as are any beyond the end
+ * of the ring.
+ * Returns the number of bytes that had not arrived before.
+ */
+int reasmInsert(reasmBuffer *ra, unsigned int seq, unsigned char *data, int len) {
+    unsigned int end = plus32(seq, len);
+
+    if (!greater32(end, ra->start)) return 0;
+    if (greater32(ra->start, seq)) {
+        unsigned int skip = minus32(ra->start, seq);
+        data += skip;
+        len -= skip;
+        seq = ra->start;
+    }
+    if (minus32(seq, ra->start) >= ra->size) return 0;
+    if (minus32(end, ra->start) > ra->size) {
+        len = ra->size - minus32(seq, ra->start);
+        end = plus32(seq, len);
+    }
+
+    unsigned int pos = seq & (ra->size - 1);
+    unsigned int first = ra->size - pos < (unsigned int) len ? ra->size - pos : (unsigned int) len;
+    int fresh = len - bitsCount(ra->bits, pos, first) - bitsCount(ra->bits, 0, len - first);
+
+    memcpy(ra->data + pos, data, first);
+    memcpy(ra->data, data + first, len - first);
+    ringBits(ra, seq, len, 1);
+    if (greater32(end, ra->end)) ra->end = end;
+    return fresh;
+}
+
+/*
+ * Everything before seq was delivered without going through the ring:
+ * forget whatever was held for it and expect seq next.
+ */
+void reasmSkip(reasmBuffer *ra, unsigned int seq) {
+    if (!greater32(seq, ra->start)) return;
+
+    unsigned int n = minus32(seq, ra->start);
+    if (n >= ra->size) {
+        memset(ra->bits, 0, ra->size / WORD_BITS * sizeof(unsigned long long));
+    } else {
+        ringBits(ra, ra->start, n, 0);
+    }
+    ra->start = seq;
+    if (greater32(seq, ra->end)) ra->end = seq;
+}
+
+/*
+ * Take the bytes that have arrived contiguously from start. They are
+ * described by *iovCount (0, 1 or 2) entries of iov, which stay valid
+ * until an insert lands on the same part of the ring, that is until one
+ * reaches size bytes past the first byte drained.
+ * Returns the number of bytes drained.
+ */
+int reasmDrain(reasmBuffer *ra, struct iovec *iov, int *iovCount) {
+    unsigned int n = minus32(ra->end, ra->start);
+    unsigned int pos = ra->start & (ra->size - 1);
+    unsigned int first = ra->size - pos < n ? ra->size - pos : n;
+    unsigned int run = ringRun(ra, ra->start, n, 1);
+
+    *iovCount = 0;
+    if (run == 0) return 0;
+    iov[0].iov_base = ra->data + pos;
+    iov[0].iov_len = run < first ? run : first;
+    *iovCount = 1;
+    if (run > first) {
+        iov[1].iov_base = ra->data;
+        iov[1].iov_len = run - first;
+        *iovCount = 2;
+    }
+    ringBits(ra, ra->start, run, 0);
+    ra->start = plus32(ra->start, run);
+    return run;
+}
+
+/*
+ * Describe the runs of bytes held past the hole at start, lowest first,
+ * as [start, end) pairs in blocks, up to max of them.
+ * Returns the number of blocks.
+ */
+int reasmBlocks(reasmBuffer *ra, unsigned int (*blocks)[2], int max) {
+    unsigned int seq = ra->start;
+    int count = 0;
+
+    while (count < max && greater32(ra->end, seq)) {
+        seq = plus32(seq, ringRun(ra, seq, minus32(ra->end, seq), 0));
+        if (!greater32(ra->end, seq)) break;
+        unsigned int run = ringRun(ra, seq, minus32(ra->end, seq), 1);
+        blocks[count][0] = seq;
+        blocks[count][1] = seq = plus32(seq, run);
+        count++;
+    }
+    return count;
+}
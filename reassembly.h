@@ -0,0 +1,30 @@
+#ifndef __REASSEMBLY_H__
+#define __REASSEMBLY_H__
+#include <sys/uio.h>
+
+/*
+ * Out-of-order data waiting for the hole before it. Bytes are stored in
+ * a ring at (seq % size) with one bit per byte recording which have
+ * arrived, so an insert is a copy and a few word operations however far
+ * ahead of the hole it lands, and once the hole fills the whole
+ * contiguous prefix comes out as at most two iovecs, ready for writev().
+ *
+ * Sequence numbers wrap as in wraparound.h. The caller keeps every
+ * insert inside [start, start + size).
+ */
+
+typedef struct {
+    unsigned char *data;
+    unsigned long long *bits;       /* bit i set once data[i] holds a byte that arrived */
+    unsigned int size;              /* a power of two */
+    unsigned int start;             /* sequence number of the next byte to drain */
+    unsigned int end;               /* one past the furthest byte held, start if none */
+} reasmBuffer;
+
+extern int reasmInit(reasmBuffer *ra, unsigned int size, unsigned int start);
+extern void reasmFree(reasmBuffer *ra);
+extern int reasmInsert(reasmBuffer *ra, unsigned int seq, unsigned char *data, int len);
+extern void reasmSkip(reasmBuffer *ra, unsigned int seq);
+extern int reasmDrain(reasmBuffer *ra, struct iovec *iov, int *iovCount);
+extern int reasmBlocks(reasmBuffer *ra, unsigned int (*blocks)[2], int max);
+#endif
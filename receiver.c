@@ -0,0 +1,755 @@
+/************************************************************************
+ * The STCP receiver.
+ *
+ * Accepts one connection from an STCP sender and writes what it
+ * receives to a file called OutputFile, then exits. It speaks the same
+ * protocol as the prebuilt receiver_* binaries and reads the same
+ * script files to inject faults, but is built for throughput:
+ *
+ *  - datagrams are read STCP_IO_BATCH buffers at a time, and with UDP GRO
+ *    each buffer may hold a whole run of segments;
+ *  - data that arrives in order goes to OutputFile with one writev()
+ *    per batch straight out of the receive buffers, and only segments
+ *    that arrive early are copied, into a ring that is drained in one
+ *    go once the hole before them fills;
+ *  - ACKs are queued on a packetBatch and leave with sendmmsg(), and
+ *    carry SACK blocks for the data held past a hole. Data that arrives
+ *    in order is ACKed every second segment, or after a short delay.
+ *
+ *************************************************************************/
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "stcp.h"
+#include "timerwheel.h"
+#include "pktpool.h"
+#include "script.h"
+#include "reassembly.h"
+
+#define STCP_SUCCESS 1
+#define STCP_ERROR -1
+
+#define STCP_RECV_WINDOW   (1 << 20)    /* receive buffer, when the sender accepts window scaling */
+#define STCP_MAX_EVENTS    4
+#define STCP_MAX_READS     4            /* recvmmsg() calls per readable event */
+#define STCP_IDLE_LIMIT    3            /* infinite timeouts without a packet before giving up */
+#define STCP_CONSUME_DELAY 100          /* most ms a slow application takes to consume data */
+#define STCP_DELAYED_ACK   5            /* most ms an ACK is held back, below the sender's RTO floor */
+#define STCP_ACK_SEGMENTS  2            /* full segments in order that are ACKed at once */
+#define STCP_OUTPUT_FILE   "OutputFile"
+
+/*
+ * A datagram the script delays or swaps, kept as it came off the wire,
+ * in network byte order.
+ */
+typedef struct heldSegment {
+    struct heldSegment *next;
+    twTimer timer;              /* when a delayed segment is let through */
+    int dir;                    /* SCRIPT_IN or SCRIPT_OUT */
+    int type;                   /* SCRIPT_DATA, ... */
+    int len;
+    unsigned char data[];
+} heldSegment;
+
+typedef struct {
+    int fd;
+    int epfd;                   /* epoll set watching fd and timerfd */
+    int timerfd;                /* fires at the wheel's next expiry */
+    long timerfdExpiry;         /* absolute time timerfd is armed for, -1 if idle */
+    timerWheel wheel;
+    int state;
+    unsigned int initSeq;       /* our ISN */
+    unsigned int seq;           /* sequence number of our ACKs */
+    unsigned int peerSeq;       /* the sender's ISN */
+    unsigned int rcvNxt;        /* next byte expected */
+    unsigned int window;        /* bytes the receive buffer holds */
+    unsigned int unconsumed;    /* delivered, but not yet consumed by the application */
+    unsigned int advertised;    /* window in the most recent ACK */
+    int windowShift;            /* scale applied to every window after the SYN-ACK */
+    int mss;
+    int sackOk;                 /* the sender permits SACK blocks on our ACKs */
+    reasmBuffer reasm;          /* data past a hole */
+    int ringPending;            /* data drained from reasm is waiting to be written */
+    unsigned int ringPendingFrom; /* sequence number of the first such byte */
+    heldSegment *swapped[SCRIPT_DIRECTIONS]; /* waiting to go after the next segment */
+    unsigned int ackPending;    /* bytes delivered in order since the last ACK */
+    twTimer delAckTimer;        /* sends the ACK for them if no more arrive */
+    twTimer consumeTimer;       /* a slow application gets round to its data */
+    twTimer timeWaitTimer;
+    int scripted;
+    script script;
+    int output;
+    struct iovec outIov[IOV_MAX]; /* in-order data not yet written to output */
+    heldSegment *outHeld[IOV_MAX]; /* the held segment each outIov points into, if any */
+    int outCount;
+    unsigned char *rxBufs;      /* STCP_IO_BATCH buffers of STCP_GRO_BUFFER bytes */
+    int rxLens[STCP_IO_BATCH];
+    int rxSegSizes[STCP_IO_BATCH];
+    unsigned char txBufs[STCP_IO_BATCH][sizeof(tcpheader) + TCP_MAX_OPTIONS];
+    packetBatch txBatch;
+    pktPool pool;               /* every heldSegment */
+    int idle;                   /* infinite timeouts in a row without a packet */
+    unsigned long delivered;
+    int counts[SCRIPT_DIRECTIONS][SCRIPT_TYPES];
+} stcp_recv_ctrl_blk;
+
+#define STCP_HELD_BLOCK (sizeof(heldSegment) + STCP_MAX_MTU)
+
+/*
+ * Arm the timerfd for the wheel's next expiry, if that changed.
+ */
+static void syncTimer(stcp_recv_ctrl_blk *cb) {
+    struct itimerspec its;
+    long next = twNextExpiry(&cb->wheel);
+
+    if (next == cb->timerfdExpiry) return;
+    cb->timerfdExpiry = next;
+
+    memset(&its, 0, sizeof(its));
+    if (next >= 0) {
+        long ms = max(next - now(), 0);
+        its.it_value.tv_sec = ms / 1000;
+        its.it_value.tv_nsec = (ms % 1000) * 1000000;
+        if (ms == 0) its.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime(cb->timerfd, 0, &its, NULL) < 0) {
+        logPerror("timerfd_settime");
+    }
+}
+
+static heldSegment *holdSegment(stcp_recv_ctrl_blk *cb, int dir, int type, unsigned char *buf, int len) {
+    heldSegment *held = poolAlloc(&cb->pool);
+    if (held == NULL) {
+        logLog("failure", "Memory allocation failed");
+        return NULL;
+    }
+    memset(held, 0, sizeof(*held));
+    held->dir = dir;
+    held->type = type;
+    held->len = len;
+    memcpy(held->data, buf, len);
+    return held;
+}
+
+/*
+ * Flip one random bit of a datagram.
+ */
+static void corrupt(unsigned char *buf, int len) {
+    int pos = random() % len;
+    unsigned char old = buf[pos];
+
+    buf[pos] ^= 1 << (random() % 8);
+    logLog("event", "corrupted: byte %d from %02x to %02x", pos, old, buf[pos]);
+}
+
+/*
+ * Write every piece of in-order data gathered so far to the output, then
+ * let go of the held segments it came from. Receive buffers are reused
+ * by the next read, so this runs at the end of every batch.
+ */
+static int flushDelivery(stcp_recv_ctrl_blk *cb) {
+    struct iovec *iov = cb->outIov;
+    int count = cb->outCount;
+    int res = STCP_SUCCESS;
+
+    while (count > 0) {
+        ssize_t n = writev(cb->output, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            logPerror(STCP_OUTPUT_FILE);
+            res = STCP_ERROR;
+            break;
+        }
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    for (int i = 0; i < cb->outCount; i++) {
+        if (cb->outHeld[i]) poolFree(&cb->pool, cb->outHeld[i]);
+    }
+    cb->outCount = 0;
+    cb->ringPending = 0;
+    return res;
+}
+
+static int flushOutput(stcp_recv_ctrl_blk *cb) {
+    if (cb->txBatch.count == 0) return STCP_SUCCESS;
+    if (writeBatch(cb->fd, &cb->txBatch) == STCP_READ_PERMANENT_FAILURE) return STCP_ERROR;
+    return STCP_SUCCESS;
+}
+
+static void queueTx(stcp_recv_ctrl_blk *cb, unsigned char *buf, int len) {
+    if (batchFull(&cb->txBatch)) flushOutput(cb);
+    unsigned char *slot = cb->txBufs[cb->txBatch.count];
+    memcpy(slot, buf, len);
+    batchAdd(&cb->txBatch, slot, len, NULL, 0);
+}
+
+/*
+ * Send a datagram, or do to it whatever the script says.
+ */
+static void transmit(stcp_recv_ctrl_blk *cb, int type, unsigned char *buf, int len) {
+    int action = SCRIPT_PASS;
+    int delay = 0;
+
+    cb->counts[SCRIPT_OUT][type]++;
+    if (cb->scripted) action = scriptAction(&cb->script, SCRIPT_OUT, type, &delay);
+
+    if (action == SCRIPT_DROP) {
+        logLog("event", "Dropped transmitted %s", scriptTypeName[type]);
+        return;
+    }
+    if (action == SCRIPT_CORRUPT) corrupt(buf, len);
+    if (action == SCRIPT_DELAY || action == SCRIPT_SWAP) {
+        heldSegment *held = holdSegment(cb, SCRIPT_OUT, type, buf, len);
+        if (held == NULL) return;
+        if (action == SCRIPT_DELAY) {
+            logLog("event", "Delaying transmitted %s for %d ms", scriptTypeName[type], delay);
+            twSchedule(&cb->wheel, &held->timer, now() + delay);
+            return;
+        }
+        /* One that was already waiting goes now, so nothing is held for long */
+        heldSegment *waiting = cb->swapped[SCRIPT_OUT];
+        logLog("event", "Swapping transmitted %s", scriptTypeName[type]);
+        cb->swapped[SCRIPT_OUT] = held;
+        if (waiting) {
+            queueTx(cb, waiting->data, waiting->len);
+            poolFree(&cb->pool, waiting);
+        }
+        return;
+    }
+
+    queueTx(cb, buf, len);
+    heldSegment *waiting = cb->swapped[SCRIPT_OUT];
+    if (waiting) {
+        logLog("event", "Sending swapped %s", scriptTypeName[waiting->type]);
+        cb->swapped[SCRIPT_OUT] = NULL;
+        queueTx(cb, waiting->data, waiting->len);
+        poolFree(&cb->pool, waiting);
+    }
+}
+
+/*
+ * The window to advertise: the receive buffer less what the application
+ * has not consumed. Data held past a hole sits inside this window, so
+ * it does not shrink it.
+ */
+static unsigned int receiveWindow(stcp_recv_ctrl_blk *cb) {
+    return cb->unconsumed >= cb->window ? 0 : cb->window - cb->unconsumed;
+}
+
+/*
+ * Send a segment carrying flags, seq and the next byte expected, with
+ * options after the header if optLen is nonzero.
+ */
+static void sendSegment(stcp_recv_ctrl_blk *cb, int flags, unsigned int seq, unsigned char *options, int optLen) {
+    unsigned char buf[sizeof(tcpheader) + TCP_MAX_OPTIONS];
+    tcpheader *hdr = (tcpheader *) buf;
+    int len = sizeof(tcpheader) + optLen;
+    unsigned int window = receiveWindow(cb);
+    int shift = (flags & SYN) ? 0 : cb->windowShift;    /* a SYN's window is never scaled */
+
+    cb->advertised = min(window >> shift, STCP_MAXWIN) << shift;
+    if (flags & ACK) {
+        cb->ackPending = 0;
+        twCancel(&cb->wheel, &cb->delAckTimer);
+    }
+    createHeader(hdr, flags, cb->advertised >> shift, seq, cb->rcvNxt);
+    hdr->dataOffset = len / 4;
+    memcpy(buf + sizeof(tcpheader), options, optLen);
+    dump('s', hdr, len);
+
+    int type = scriptClassify(hdr, len);
+    htonHdr(hdr);
+    hdr->checksum = ipchecksum(buf, len);
+    transmit(cb, type, buf, len);
+}
+
+/*
+ * ACK everything up to rcvNxt. If the sender permits SACK and data is
+ * held past a hole, the ACK also reports the lowest runs of it, which
+ * are the ones the sender should resend around first.
+ */
+static void sendAck(stcp_recv_ctrl_blk *cb) {
+    unsigned char options[TCP_MAX_OPTIONS];
+    tcpoptions sack = { .sackBlocks = 0 };
+    int optLen = 0;
+
+    if (cb->sackOk && greater32(cb->reasm.end, cb->reasm.start)) {
+        sack.sackBlocks = reasmBlocks(&cb->reasm, sack.sack, TCP_MAX_SACK);
+        if (sack.sackBlocks > 0) optLen = tcpWriteOptions(options, &sack);
+    }
+    sendSegment(cb, ACK, cb->seq, options, optLen);
+}
+
+/*
+ * Account for data handed to the application. A slow application
+ * leaves it in the receive buffer for a while, which closes the window.
+ */
+static void consume(stcp_recv_ctrl_blk *cb, int length) {
+    if (!cb->scripted || !scriptConsumeSlowly(&cb->script)) return;
+
+    logLog("event", "Delayed consuming %d bytes", length);
+    cb->unconsumed += length;
+    if (!twPending(&cb->consumeTimer)) {
+        twSchedule(&cb->wheel, &cb->consumeTimer, now() + 1 + random() % STCP_CONSUME_DELAY);
+    }
+}
+
+static void consumeExpired(stcp_recv_ctrl_blk *cb) {
+    logLog("event", "Consume: %d bytes", cb->unconsumed);
+    cb->unconsumed = 0;
+
+    /* A sender that was held back by the window only hears of it from us */
+    if (cb->state == STCP_RECEIVER_ESTABLISHED && cb->advertised < (unsigned int) cb->mss) {
+        logLog("event", "rwnd adjusted to %u", receiveWindow(cb));
+        sendAck(cb);
+    }
+}
+
+/*
+ * Pass length bytes at data, the next ones expected, to the output.
+ * owner, if not NULL, is the held segment data lives in; it is freed
+ * once the data is written.
+ */
+static void deliver(stcp_recv_ctrl_blk *cb, unsigned char *data, int length, heldSegment *owner) {
+    if (cb->outCount == IOV_MAX) flushDelivery(cb);
+    cb->outIov[cb->outCount].iov_base = data;
+    cb->outIov[cb->outCount].iov_len = length;
+    cb->outHeld[cb->outCount++] = owner;
+    cb->rcvNxt = plus32(cb->rcvNxt, length);
+    cb->delivered += length;
+    consume(cb, length);
+}
+
+/*
+ * Deliver the data held past a hole that rcvNxt has now reached. It is
+ * written from the ring, so until the next flush no insert may reach the
+ * ring's size past the first byte drained.
+ */
+static void deliverBuffered(stcp_recv_ctrl_blk *cb) {
+    struct iovec iov[2];
+    int count;
+    unsigned int from = cb->rcvNxt;
+
+    if (reasmDrain(&cb->reasm, iov, &count) == 0) return;
+    if (!cb->ringPending) {
+        cb->ringPending = 1;
+        cb->ringPendingFrom = from;
+    }
+    logLog("event", "Delivering buffered data %u-%u", from, cb->reasm.start);
+    for (int i = 0; i < count; i++) deliver(cb, iov[i].iov_base, iov[i].iov_len, NULL);
+}
+
+/*
+ * Keep data that arrived past a hole until the hole is filled.
+ */
+static void bufferOutOfOrder(stcp_recv_ctrl_blk *cb, unsigned int seq, unsigned char *data, int length) {
+    if (cb->ringPending && minus32(plus32(seq, length), cb->ringPendingFrom) > cb->reasm.size) {
+        flushDelivery(cb);
+    }
+    if (reasmInsert(&cb->reasm, seq, data, length) == 0) {
+        logLog("event", "Duplicate data packet %u", seq);
+    }
+}
+
+/*
+ * A data segment arrived while established. Everything that ends before
+ * rcvNxt is a duplicate, anything ahead of it that fits in the window
+ * waits for the hole, and the rest is delivered.
+ *
+ * Data that arrives in order is ACKed every STCP_ACK_SEGMENTS full
+ * segments, or STCP_DELAYED_ACK ms after the first that is not, as in
+ * TCP. Anything else is ACKed at once, so a hole shows up at the sender
+ * as duplicate ACKs, and so does the news that it has been filled.
+ */
+static void processData(stcp_recv_ctrl_blk *cb, tcpheader *hdr, unsigned char *buf, int len,
+                        heldSegment *owner) {
+    int offset = tcpHeaderLength(hdr, len);
+    int length = len - offset;
+    unsigned int end = plus32(hdr->seqNo, length);
+
+    if (!greater32(end, cb->rcvNxt)) {
+        logLog("event", "Duplicate data packet %u", hdr->seqNo);
+        if (owner) poolFree(&cb->pool, owner);
+    } else if (greater32(end, plus32(cb->rcvNxt, receiveWindow(cb)))) {
+        logLog("event", "Packet seqno too large to fit in receive window - ignored.");
+        if (owner) poolFree(&cb->pool, owner);
+    } else if (greater32(hdr->seqNo, cb->rcvNxt)) {
+        bufferOutOfOrder(cb, hdr->seqNo, buf + offset, length);
+        if (owner) poolFree(&cb->pool, owner);
+    } else {
+        unsigned int skip = minus32(cb->rcvNxt, hdr->seqNo);
+        deliver(cb, buf + offset + skip, length - skip, owner);
+        reasmSkip(&cb->reasm, cb->rcvNxt);
+        cb->ackPending += length - skip;
+        if (!greater32(cb->reasm.end, cb->reasm.start)) {
+            if (cb->ackPending >= (unsigned int) (STCP_ACK_SEGMENTS * cb->mss)) {
+                sendAck(cb);
+            } else if (!twPending(&cb->delAckTimer)) {
+                twSchedule(&cb->wheel, &cb->delAckTimer, now() + STCP_DELAYED_ACK);
+            }
+            return;
+        }
+        deliverBuffered(cb);
+    }
+    sendAck(cb);
+}
+
+/*
+ * Answer a SYN, agreeing to its MSS, window scaling and SACK options if
+ * it carried any.
+ */
+static void acceptSyn(stcp_recv_ctrl_blk *cb, tcpheader *hdr, unsigned char *buf, int len) {
+    unsigned char options[TCP_MAX_OPTIONS];
+    tcpoptions offer;
+    tcpoptions answer = { .mss = STCP_MAX_MTU - sizeof(tcpheader) };
+
+    if (cb->state == STCP_RECEIVER_LISTEN) {
+        tcpParseOptions(buf, len, &offer);
+        cb->peerSeq = hdr->seqNo;
+        cb->rcvNxt = plus32(hdr->seqNo, 1);
+        cb->seq = plus32(cb->initSeq, 1);
+        cb->mss = offer.mss > 0 ? min(offer.mss, answer.mss) : STCP_MSS;
+        cb->sackOk = offer.sackPermitted;
+        if (offer.hasWscale) {
+            while ((cb->window >> cb->windowShift) > STCP_MAXWIN) cb->windowShift++;
+        } else {
+            cb->window = STCP_MAXWIN;
+        }
+        if (reasmInit(&cb->reasm, cb->window, cb->rcvNxt) < 0) {
+            logLog("failure", "Memory allocation failed");
+            cb->state = STCP_RECEIVER_CLOSED;
+            return;
+        }
+        cb->state = STCP_RECEIVER_ESTABLISHED;
+        logLog("init", "Connection established, MSS %d, window %u, window scale %d%s",
+               cb->mss, cb->window, cb->windowShift, cb->sackOk ? ", SACK" : "");
+    } else {
+        logLog("event", "Resending SYN ACK");
+    }
+
+    /* Only a SYN that offered scaling leaves the window above 64K */
+    answer.hasWscale = cb->window > STCP_MAXWIN;
+    answer.wscale = cb->windowShift;
+    answer.sackPermitted = cb->sackOk;
+    sendSegment(cb, SYN | ACK, cb->initSeq, options, tcpWriteOptions(options, &answer));
+}
+
+static void enterTimeWait(stcp_recv_ctrl_blk *cb) {
+    if (cb->state != STCP_RECEIVER_TIME_WAIT) {
+        logLog("init", "State is now time_wait");
+        cb->rcvNxt = plus32(cb->rcvNxt, 1);
+        cb->state = STCP_RECEIVER_TIME_WAIT;
+    } else {
+        logLog("event", "Got another FIN in time_wait, resending ACK");
+    }
+    twSchedule(&cb->wheel, &cb->timeWaitTimer, now() + STCP_TIME_WAIT_DURATION);
+    sendSegment(cb, FIN | ACK, cb->seq, NULL, 0);
+}
+
+/*
+ * Act on one datagram that made it past the script. owner is the held
+ * segment it lives in, or NULL if it is in a receive buffer; either way
+ * this decides what becomes of it.
+ */
+static void processSegment(stcp_recv_ctrl_blk *cb, unsigned char *buf, int len, heldSegment *owner) {
+    tcpheader hdr;
+    unsigned short check = ipchecksum(buf, len);
+
+    memcpy(&hdr, buf, sizeof(tcpheader));
+    ntohHdr(&hdr);
+    if (check != 0) {
+        logLog("error", "Checksum %04x isn't 0. Ignoring packet.", check);
+    } else if (getRst(&hdr)) {
+        logLog("failure", "Connection reset by sender");
+        cb->state = STCP_RECEIVER_CLOSED;
+    } else if (getSyn(&hdr)) {
+        if (cb->state == STCP_RECEIVER_LISTEN || hdr.seqNo == cb->peerSeq) {
+            acceptSyn(cb, &hdr, buf, len);
+        } else {
+            logLog("error", "Got a SYN for another connection, ignoring it");
+        }
+    } else if (cb->state == STCP_RECEIVER_LISTEN) {
+        logLog("error", "Expecting SYN in state listen, ignoring packet");
+    } else if (getFin(&hdr)) {
+        if (cb->state == STCP_RECEIVER_TIME_WAIT || hdr.seqNo == cb->rcvNxt) {
+            enterTimeWait(cb);
+        } else {
+            logLog("event", "FIN seq %u not equal to next byte expected %u - ignoring", hdr.seqNo, cb->rcvNxt);
+            sendAck(cb);
+        }
+    } else if (len > tcpHeaderLength(&hdr, len)) {
+        processData(cb, &hdr, buf, len, owner);
+        return;
+    }
+    if (owner) poolFree(&cb->pool, owner);
+}
+
+/*
+ * One datagram came off the wire: do to it whatever the script says,
+ * then process it.
+ */
+static void receiveSegment(stcp_recv_ctrl_blk *cb, unsigned char *buf, int len) {
+    tcpheader hdr;
+    int action = SCRIPT_PASS;
+    int delay = 0;
+
+    if (len < (int) sizeof(tcpheader) || len > STCP_MAX_MTU) {
+        logLog("error", "Datagram of %d bytes is no STCP segment, ignoring it", len);
+        return;
+    }
+    memcpy(&hdr, buf, sizeof(tcpheader));
+    ntohHdr(&hdr);
+    int type = scriptClassify(&hdr, len);
+    cb->counts[SCRIPT_IN][type]++;
+    if (cb->scripted) action = scriptAction(&cb->script, SCRIPT_IN, type, &delay);
+
+    heldSegment *waiting = cb->swapped[SCRIPT_IN];
+    cb->swapped[SCRIPT_IN] = NULL;
+
+    if (action == SCRIPT_DROP) {
+        logLog("event", "Dropping received %s", scriptTypeName[type]);
+    } else if (action == SCRIPT_DELAY || action == SCRIPT_SWAP) {
+        heldSegment *held = holdSegment(cb, SCRIPT_IN, type, buf, len);
+        if (held && action == SCRIPT_DELAY) {
+            logLog("event", "Delaying incoming %s for %d.%03ds", scriptTypeName[type], delay / 1000, delay % 1000);
+            twSchedule(&cb->wheel, &held->timer, now() + delay);
+        } else if (held) {
+            logLog("event", "Swapping received %s", scriptTypeName[type]);
+            cb->swapped[SCRIPT_IN] = held;
+        }
+    } else {
+        if (action == SCRIPT_CORRUPT) corrupt(buf, len);
+        processSegment(cb, buf, len, NULL);
+    }
+
+    if (waiting) {
+        logLog("event", "Delivering swapped %s", scriptTypeName[waiting->type]);
+        processSegment(cb, waiting->data, waiting->len, waiting);
+    }
+}
+
+/*
+ * The socket is readable: read what is queued a batch at a time, split
+ * coalesced buffers back into segments, and process each.
+ */
+static int handleInput(stcp_recv_ctrl_blk *cb) {
+    int n = STCP_IO_BATCH;
+
+    cb->idle = 0;
+    for (int reads = 0; n == STCP_IO_BATCH && reads < STCP_MAX_READS; reads++) {
+        n = readBatch(cb->fd, cb->rxBufs, STCP_GRO_BUFFER, cb->rxLens, cb->rxSegSizes, STCP_IO_BATCH);
+        if (n == STCP_READ_PERMANENT_FAILURE) return STCP_ERROR;
+        if (n == STCP_READ_TIMED_OUT) break;
+
+        for (int i = 0; i < n; i++) {
+            unsigned char *buf = cb->rxBufs + (size_t) i * STCP_GRO_BUFFER;
+            int segSize = cb->rxSegSizes[i] > 0 ? cb->rxSegSizes[i] : cb->rxLens[i];
+            for (int off = 0; off < cb->rxLens[i]; off += segSize) {
+                receiveSegment(cb, buf + off, min(segSize, cb->rxLens[i] - off));
+            }
+        }
+        if (flushDelivery(cb) == STCP_ERROR) return STCP_ERROR;
+        if (flushOutput(cb) == STCP_ERROR) return STCP_ERROR;
+    }
+    return STCP_SUCCESS;
+}
+
+/*
+ * The timerfd fired: run every timer on the wheel that is now due.
+ */
+static int handleTimeout(stcp_recv_ctrl_blk *cb) {
+    uint64_t expirations;
+    twTimer *t;
+
+    if (read(cb->timerfd, &expirations, sizeof(expirations)) < 0) return STCP_SUCCESS;
+    cb->timerfdExpiry = -1;
+
+    long time = now();
+    while ((t = twExpired(&cb->wheel, time)) != NULL) {
+        if (t == &cb->delAckTimer) {
+            sendAck(cb);
+        } else if (t == &cb->consumeTimer) {
+            consumeExpired(cb);
+        } else if (t == &cb->timeWaitTimer) {
+            logLog("init", "State is now closed");
+            cb->state = STCP_RECEIVER_CLOSED;
+        } else {
+            heldSegment *held = twEntry(t, heldSegment, timer);
+            if (held->dir == SCRIPT_IN) {
+                processSegment(cb, held->data, held->len, held);
+            } else {
+                queueTx(cb, held->data, held->len);
+                poolFree(&cb->pool, held);
+            }
+        }
+    }
+    if (flushDelivery(cb) == STCP_ERROR) return STCP_ERROR;
+    return flushOutput(cb);
+}
+
+/*
+ * Run one iteration of the event loop.
+ */
+static int receiverPoll(stcp_recv_ctrl_blk *cb) {
+    struct epoll_event events[STCP_MAX_EVENTS];
+    int n = epoll_wait(cb->epfd, events, STCP_MAX_EVENTS, STCP_INFINITE_TIMEOUT);
+
+    if (n < 0) {
+        if (errno == EINTR) return STCP_SUCCESS;
+        logPerror("epoll_wait");
+        return STCP_ERROR;
+    }
+    if (n == 0 && ++cb->idle >= STCP_IDLE_LIMIT) {
+        logLog("failure", "Nothing received for %d ms, giving up", STCP_IDLE_LIMIT * STCP_INFINITE_TIMEOUT);
+        return STCP_ERROR;
+    }
+    for (int i = 0; i < n; i++) {
+        int res = events[i].data.fd == cb->fd ? handleInput(cb) : handleTimeout(cb);
+        if (res == STCP_ERROR) return STCP_ERROR;
+    }
+    syncTimer(cb);
+    return STCP_SUCCESS;
+}
+
+/*
+ * Open the socket and output file and get ready to listen.
+ */
+static stcp_recv_ctrl_blk *receiverOpen(char *source, int sendersPort, int receiversPort) {
+    struct epoll_event ev;
+
+    logLog("init", "Receiving on port %d from <%s, %d>", receiversPort, source, sendersPort);
+    int fd = udp_open(source, sendersPort, receiversPort);
+    if (fd < 0) return NULL;
+
+    stcp_recv_ctrl_blk *cb = calloc(1, sizeof(stcp_recv_ctrl_blk));
+    if (cb == NULL || poolInit(&cb->pool, STCP_HELD_BLOCK) < 0 ||
+        (cb->rxBufs = malloc((size_t) STCP_IO_BATCH * STCP_GRO_BUFFER)) == NULL) {
+        logLog("failure", "Memory allocation failed");
+        close(fd);
+        return NULL;
+    }
+
+    cb->fd = fd;
+    cb->txBatch.gso = udpGsoSupported(fd);
+    if (udpEnableGro(fd) < 0) logLog("init", "UDP GRO not supported, reading datagrams one at a time");
+    cb->state = STCP_RECEIVER_LISTEN;
+    cb->initSeq = random();
+    cb->window = STCP_RECV_WINDOW;
+    cb->mss = STCP_MSS;
+
+    cb->output = open(STCP_OUTPUT_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    cb->epfd = epoll_create1(0);
+    cb->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (cb->output < 0 || cb->epfd < 0 || cb->timerfd < 0) {
+        logPerror("receiverOpen");
+        return NULL;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = cb->fd;
+    if (epoll_ctl(cb->epfd, EPOLL_CTL_ADD, cb->fd, &ev) < 0) {
+        logPerror("epoll_ctl");
+        return NULL;
+    }
+    ev.data.fd = cb->timerfd;
+    if (epoll_ctl(cb->epfd, EPOLL_CTL_ADD, cb->timerfd, &ev) < 0) {
+        logPerror("epoll_ctl");
+        return NULL;
+    }
+    twInit(&cb->wheel, now());
+    cb->timerfdExpiry = -1;
+    logLog("init", "State is now listen");
+    return cb;
+}
+
+static void receiverClose(stcp_recv_ctrl_blk *cb) {
+    for (int dir = 0; dir < SCRIPT_DIRECTIONS; dir++) {
+        for (int type = 0; type < SCRIPT_TYPES; type++) {
+            logLog("stats", "%s %s = %d", scriptDirName[dir], scriptTypeName[type], cb->counts[dir][type]);
+        }
+    }
+    logLog("stats", "%lu bytes delivered", cb->delivered);
+
+    close(cb->output);
+    close(cb->timerfd);
+    close(cb->epfd);
+    close(cb->fd);
+    scriptFree(&cb->script);
+    reasmFree(&cb->reasm);
+    poolDestroy(&cb->pool);
+    free(cb->rxBufs);
+    free(cb);
+}
+
+/*
+ * Receive one file into OutputFile.
+ */
+int main(int argc, char **argv) {
+    char *sourceHost = "localhost";
+    int sendersPort = getDefaultPort() + 1;
+    int receiversPort = getDefaultPort();
+    char *scriptFile = NULL;
+    unsigned int seed = time(NULL);
+
+    logConfig("receiver", "init,event,error,failure,stats");
+
+    /*
+     * STCP_TRACE names a file to trace packets to in binary instead (see
+     * tracedump), and STCP_PCAP one to capture them to for Wireshark
+     */
+    if (getenv("STCP_TRACE") && traceStart(getenv("STCP_TRACE")) < 0) exit(1);
+    if (getenv("STCP_PCAP") && captureStart(getenv("STCP_PCAP")) < 0) exit(1);
+
+    if (argc == 2) {
+        scriptFile = argv[1];
+    } else if (argc >= 4 && argc <= 6) {
+        sourceHost = argv[1];
+        sendersPort = atoi(argv[2]);
+        receiversPort = atoi(argv[3]);
+        if (argc > 4) scriptFile = argv[4];
+        if (argc > 5) seed = atoi(argv[5]);
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: receiver ReceiveDataFromHost doRecvOnPort sendResponseToPort [scriptFile] [randomSeed]\n");
+        fprintf(stderr, "or   : receiver [scriptFile]\n");
+        exit(1);
+    }
+    logLog("init", "Using random seed %u", seed);
+    srandom(seed);
+
+    stcp_recv_ctrl_blk *cb = receiverOpen(sourceHost, sendersPort, receiversPort);
+    if (cb == NULL) exit(1);
+    scriptInit(&cb->script);
+    if (scriptFile != NULL) {
+        if (scriptLoad(&cb->script, scriptFile) < 0) exit(1);
+        cb->scripted = 1;
+    }
+
+    int res = STCP_SUCCESS;
+    while (res == STCP_SUCCESS && cb->state != STCP_RECEIVER_CLOSED) {
+        res = receiverPoll(cb);
+    }
+    flushDelivery(cb);
+    receiverClose(cb);
+    return res == STCP_SUCCESS ? 0 : 1;
+}
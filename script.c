@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "script.h"
+#include "log.h"
+
+#define SCRIPT_MAX_TOKENS 8
+
+const char *scriptDirName[SCRIPT_DIRECTIONS] = { "in", "out" };
+const char *scriptTypeName[SCRIPT_TYPES] = { "data", "fin", "syn", "ack" };
+const char *scriptActionName[SCRIPT_ACTIONS] = { "pass", "drop", "corrupt", "swap", "delay" };
+
+static int lookup(const char **names, int count, const char *word) {
+    for (int i = 0; i < count; i++) {
+        if (!strcmp(names[i], word)) return i;
+    }
+    return -1;
+}
+
+/*
+ * Parse a count, optionally written #n, or a percentage followed by a
+ * separate or attached %. Returns the value, or -1.
+ */
+static int number(const char *word, int percent) {
+    char *end;
+
+    if (!percent && *word == '#') word++;
+    if (!isdigit((unsigned char) *word)) return -1;
+    long n = strtol(word, &end, 10);
+    if (percent && *end == '%') end++;
+    if (*end != '\0' || n > 1000000) return -1;
+    if (percent && n > 100) return -1;
+    return n;
+}
+
+/*
+ * One statement, already split into words. A percentage may be followed
+ * by a % word of its own, which is dropped here.
+ */
+static int parseStatement(script *s, char **words, int count) {
+    if (count > 0 && !strcmp(words[count - 1], "%")) count--;
+
+    int action = lookup(scriptActionName, SCRIPT_ACTIONS, words[0]);
+    if (!strcmp(words[0], "consume")) {
+        if (count != 2 || (s->consumePercent = number(words[1], 1)) < 0) return -1;
+        return 0;
+    }
+
+    /* drop|corrupt|swap [in|out] type percentage */
+    if (action == SCRIPT_DROP || action == SCRIPT_CORRUPT || action == SCRIPT_SWAP) {
+        int w = 1;
+        int dir = count > w ? lookup(scriptDirName, SCRIPT_DIRECTIONS, words[w]) : -1;
+        if (dir >= 0) w++;
+        if (count != w + 2) return -1;
+        int type = lookup(scriptTypeName, SCRIPT_TYPES, words[w]);
+        int percent = number(words[w + 1], 1);
+        if (type < 0 || percent < 0) return -1;
+        for (int d = 0; d < SCRIPT_DIRECTIONS; d++) {
+            if (dir < 0 || dir == d) s->percent[d][type][action] = percent;
+        }
+        return 0;
+    }
+
+    /* in|out type ordinal action [ms] */
+    scriptEvent ev;
+    if (count < 4) return -1;
+    ev.dir = lookup(scriptDirName, SCRIPT_DIRECTIONS, words[0]);
+    ev.type = lookup(scriptTypeName, SCRIPT_TYPES, words[1]);
+    ev.ordinal = number(words[2], 0);
+    ev.action = lookup(scriptActionName, SCRIPT_ACTIONS, words[3]);
+    ev.delay = 0;
+    if (ev.dir < 0 || ev.type < 0 || ev.ordinal < 1 || ev.action <= SCRIPT_PASS) return -1;
+    if (ev.action == SCRIPT_DELAY) {
+        if (count != 5 || (ev.delay = number(words[4], 0)) < 0) return -1;
+    } else if (count != 4) {
+        return -1;
+    }
+
+    scriptEvent *events = realloc(s->events, (s->eventCount + 1) * sizeof(scriptEvent));
+    if (events == NULL) return -1;
+    s->events = events;
+    s->events[s->eventCount++] = ev;
+    return 0;
+}
+
+void scriptInit(script *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+/*
+ * Add the statements in text to the script.
+ * Returns 0, or -1 after logging the first line that does not parse.
+ */
+int scriptParse(script *s, const char *text) {
+    int lineNo = 0;
+
+    while (*text) {
+        const char *eol = strchr(text, '\n');
+        int len = eol ? eol - text : strlen(text);
+        char line[256];
+        char *words[SCRIPT_MAX_TOKENS];
+        int count = 0;
+
+        lineNo++;
+        snprintf(line, sizeof(line), "%.*s", len, text);
+        text += len + (eol != NULL);
+
+        char *comment = strstr(line, "//");
+        if (comment) *comment = '\0';
+        for (char *w = strtok(line, " \t\r"); w; w = strtok(NULL, " \t\r")) {
+            if (count == SCRIPT_MAX_TOKENS) break;
+            words[count++] = w;
+        }
+        if (count == 0) continue;
+        if (count == SCRIPT_MAX_TOKENS || parseStatement(s, words, count) < 0) {
+            logLog("error", "Script line %d not understood", lineNo);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read and parse a script file.
+ * Returns 0, or -1 if it cannot be read or does not parse.
+ */
+int scriptLoad(script *s, const char *fileName) {
+    FILE *f = fopen(fileName, "r");
+    if (f == NULL) {
+        logPerror((char *) fileName);
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    char *text = malloc(size + 1);
+    if (text == NULL || fread(text, 1, size, f) != (size_t) size) {
+        logPerror((char *) fileName);
+        free(text);
+        fclose(f);
+        return -1;
+    }
+    text[size] = '\0';
+    fclose(f);
+
+    int res = scriptParse(s, text);
+    free(text);
+    return res;
+}
+
+void scriptFree(script *s) {
+    free(s->events);
+    scriptInit(s);
+}
+
+/*
+ * The type of a segment of len bytes, its header in host byte order.
+ */
+int scriptClassify(tcpheader *hdr, int len) {
+    if (len > tcpHeaderLength(hdr, len)) return SCRIPT_DATA;
+    if (getFin(hdr)) return SCRIPT_FIN;
+    if (getSyn(hdr)) return SCRIPT_SYN;
+    return SCRIPT_ACK;
+}
+
+/*
+ * Decide what happens to the next segment of a type going in a
+ * direction. A specific event for its ordinal wins; otherwise drop,
+ * corrupt and swap each get their chance in turn. *delay is set for
+ * SCRIPT_DELAY.
+ */
+int scriptAction(script *s, int dir, int type, int *delay) {
+    int ordinal = ++s->seen[dir][type];
+
+    for (int i = 0; i < s->eventCount; i++) {
+        scriptEvent *ev = &s->events[i];
+        if (ev->dir == dir && ev->type == type && ev->ordinal == ordinal) {
+            *delay = ev->delay;
+            return ev->action;
+        }
+    }
+    for (int action = SCRIPT_DROP; action <= SCRIPT_SWAP; action++) {
+        int percent = s->percent[dir][type][action];
+        if (percent > 0 && random() % 100 < percent) return action;
+    }
+    return SCRIPT_PASS;
+}
+
+/*
+ * Return 1 if the application should be slow to consume the data it
+ * was just given.
+ */
+int scriptConsumeSlowly(script *s) {
+    return s->consumePercent > 0 && random() % 100 < s->consumePercent;
+}
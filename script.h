@@ -0,0 +1,68 @@
+#ifndef __SCRIPT_H__
+#define __SCRIPT_H__
+#include "tcp.h"
+
+/*
+ * Fault injection for the receiver, read from a script file. Each line
+ * is one of
+ *
+ *     drop|corrupt|swap [in|out] syn|fin|ack|data percentage%
+ *     consume percentage%
+ *     in|out syn|fin|ack|data ordinal drop|corrupt|swap|delay ms
+ *
+ * and // starts a comment. The first form affects a random share of the
+ * segments of one type, in one direction or in both; the second makes
+ * the application consume data slowly; the third affects the ordinal'th
+ * segment of a type in one direction, counting from 1.
+ *
+ * Directions are from the receiver's point of view: "in" is what the
+ * sender sent, "out" what the receiver answers.
+ */
+
+#define SCRIPT_IN   0
+#define SCRIPT_OUT  1
+#define SCRIPT_DIRECTIONS 2
+
+/* A segment has exactly one type, the first of these that fits */
+#define SCRIPT_DATA 0               /* carries a payload */
+#define SCRIPT_FIN  1
+#define SCRIPT_SYN  2
+#define SCRIPT_ACK  3
+#define SCRIPT_TYPES 4
+
+/* What to do with a segment */
+#define SCRIPT_PASS    0
+#define SCRIPT_DROP    1
+#define SCRIPT_CORRUPT 2            /* flip one bit */
+#define SCRIPT_SWAP    3            /* deliver after the next segment in its direction */
+#define SCRIPT_DELAY   4
+#define SCRIPT_ACTIONS 5
+
+typedef struct scriptEvent {
+    int dir;
+    int type;
+    int ordinal;
+    int action;
+    int delay;                      /* ms, for SCRIPT_DELAY */
+} scriptEvent;
+
+typedef struct {
+    int percent[SCRIPT_DIRECTIONS][SCRIPT_TYPES][SCRIPT_ACTIONS];
+    int consumePercent;             /* chance that delivered data is consumed slowly */
+    scriptEvent *events;
+    int eventCount;
+    int seen[SCRIPT_DIRECTIONS][SCRIPT_TYPES];
+} script;
+
+extern const char *scriptDirName[SCRIPT_DIRECTIONS];
+extern const char *scriptTypeName[SCRIPT_TYPES];
+extern const char *scriptActionName[SCRIPT_ACTIONS];
+
+extern void scriptInit(script *s);
+extern int scriptParse(script *s, const char *text);
+extern int scriptLoad(script *s, const char *fileName);
+extern void scriptFree(script *s);
+extern int scriptClassify(tcpheader *hdr, int len);
+extern int scriptAction(script *s, int dir, int type, int *delay);
+extern int scriptConsumeSlowly(script *s);
+#endif
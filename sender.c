@@ -25,50 +25,167 @@
 #include <sys/file.h>
 #include <sys/stat.h>
 
-#include <math.h>
-#include <pthread.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
 
 #include "stcp.h"
+#include "timerwheel.h"
+#include "pktpool.h"
+#include "congestion.h"
+#include "histogram.h"
+#include "stats.h"
 
 #define STCP_SUCCESS 1
 #define STCP_ERROR -1
 
+#define STCP_SEND_BUFFER   STCP_MAXWIN  /* queued, unsent bytes before stcp_send blocks */
+#define STCP_MAX_EVENTS    4
+#define STCP_MAX_ACK_BATCH 64           /* ACKs drained per readable event */
+#define STCP_DUP_ACK_THRESHOLD 3        /* duplicate ACKs that trigger fast retransmit */
+
+/* Congestion states of the sender */
+#define STCP_CA_OPEN     0              /* no loss outstanding */
+#define STCP_CA_RECOVERY 1              /* recovering from a fast retransmission */
+#define STCP_CA_LOSS     2              /* recovering from a retransmission timeout */
+#define STCP_DEFAULT_CC  ccNewReno
+
+/* Pacing modes other than a fixed rate, for stcp_set_pacing() */
+#define STCP_PACING_AUTO 0              /* pace at a gain times cwnd / srtt */
+#define STCP_PACING_OFF  -1
+#define STCP_PACE_GAIN_SS 200           /* pacing gain in percent during slow start */
+#define STCP_PACE_GAIN_CA 120           /* and in congestion avoidance */
+
+/* How stcp_send() holds back a segment shorter than the MSS, for stcp_set_coalescing() */
+#define STCP_NAGLE   0                  /* while data is in flight (the default) */
+#define STCP_NODELAY 1                  /* not at all */
+#define STCP_CORK    2                  /* until it fills, or stcp_flush() */
+#define STCP_COALESCE_DELAY 200         /* default ms a short segment may be held back */
+
+/* Latency histograms kept with -DSTCP_HISTOGRAMS, logged by stcp_close() */
+#define STCP_HIST_BUILD   0             /* building a segment: copy, header and checksum */
+#define STCP_HIST_SEND    1             /* one sendmmsg() of a batch */
+#define STCP_HIST_RELEASE 2             /* ACK read to its segments released */
+#define STCP_HIST_RTT     3             /* round-trip samples */
+#define STCP_HIST_STAGES  4
+
+/*
+ * One data segment owned by the sender. The header is kept in network
+ * byte order with the checksum filled in, and the payload is sent from
+ * wherever it lives, so a retransmission copies nothing. payload points
+ * either at data, where stcp_send() copied it, or straight into the
+ * caller's buffer for stcp_send_mapped().
+ */
+typedef struct segment {
+    struct segment *next;
+    unsigned int seq;
+    int length;                 /* payload bytes */
+    long queuedAt;              /* now() when its first byte was queued */
+    uint64_t sentNs;            /* nowNs() at the most recent transmission */
+    int transmissions;
+    int timeout;                /* this segment's rto, doubled on each expiry */
+    int sacked;                 /* the receiver holds it past a hole */
+    int lossEpoch;              /* cb->lossEpoch when last resent as a hole, 0 if never */
+#ifdef STCP_HISTOGRAMS
+    uint64_t buildNs;           /* ns newSegment() took, the checksum is added later */
+#endif
+    twTimer timer;              /* retransmission deadline while in flight */
+    tcpheader hdr;
+    unsigned char *payload;
+    unsigned char data[];
+} segment;
+
+typedef struct {
+    segment *head;
+    segment *tail;
+    unsigned int bytes;
+} segmentQueue;
+
 typedef struct {
     int fd;
+    int epfd;                   /* epoll set watching fd and timerfd */
+    int timerfd;                /* fires at the wheel's next expiry */
+    long timerfdExpiry;         /* absolute time timerfd is armed for, -1 if idle */
+    timerWheel wheel;           /* every timer the connection owns */
     int state;
     unsigned int initSeq;
-    unsigned int seq;
+    unsigned int seq;           /* next sequence number handed to a segment */
     unsigned int ack;
     unsigned int latestAck;
-    unsigned int windowStart;
-    unsigned int windowPos;
-    unsigned int windowSize;
-    pthread_t *threads;
-    pthread_mutex_t* fileLock;
-    pthread_mutex_t* logicLock;
+    unsigned int windowStart;   /* oldest unacknowledged sequence number */
+    unsigned int windowPos;     /* next sequence number to transmit */
+    unsigned int windowSize;    /* receiver's window in bytes, already scaled */
+    int windowShift;            /* window scale the receiver agreed to, or 0 */
+    int mss;                    /* payload bytes per segment, agreed in the SYN exchange */
+    int rto;                    /* retransmission timeout from the RTT estimate (ms) */
+    int rtoMin;
+    int rtoMax;
+    int rttValid;               /* srtt and rttvar hold at least one sample */
+    long srtt;                  /* smoothed round-trip time (us) */
+    long rttvar;                /* round-trip time variation (us) */
+    unsigned int sampleFrom;    /* only segments from here on may be timed */
+    twTimer persistTimer;       /* probes a window too small for the next segment */
+    int persistTimeout;
+    int dupAcks;                /* ACKs repeating windowStart while data is in flight */
+    int fastRecovery;           /* hole resent, duplicate ACKs start no other fast retransmit */
+    const ccOps *ccOps;         /* congestion control algorithm */
+    ccState cc;                 /* cwnd, ssthresh and the algorithm's own state */
+    int caState;                /* STCP_CA_OPEN, STCP_CA_RECOVERY or STCP_CA_LOSS */
+    unsigned int recover;       /* windowPos when the loss was detected */
+    int sackOk;                 /* the receiver reports SACK blocks */
+    unsigned int highSacked;    /* one past the highest byte SACKed */
+    int lossEpoch;              /* counts loss detections, to resend each hole once per recovery */
+    long paceRate;              /* bytes per second, or STCP_PACING_AUTO or STCP_PACING_OFF */
+    long paceTokens;            /* bytes that may be sent right now */
+    long paceStamp;             /* now() when paceTokens was last topped up */
+    twTimer paceTimer;          /* fires once the tokens cover the next segment */
+    int coalesce;               /* STCP_NAGLE, STCP_NODELAY or STCP_CORK */
+    int coalesceDelay;          /* most ms a short segment is held back */
+    unsigned int pushSeq;       /* data before this was flushed and is never held back */
+    twTimer coalesceTimer;      /* fires when the held segment's delay is up */
+    segmentQueue sendQueue;     /* segments not yet transmitted */
+    segmentQueue retransQueue;  /* segments in flight, oldest first */
+    packetBatch txBatch;        /* transmissions waiting for the next sendmmsg() */
+    pktPool pool;               /* every segment and packet buffer */
+    stcp_stats stats;           /* what stcp_get_stats() reports */
+    uint64_t establishedNs;     /* nowNs() when the handshake completed */
+    statsExporter *exporter;    /* writes the stats out periodically, or NULL */
+#ifdef STCP_HISTOGRAMS
+    histogram hist[STCP_HIST_STAGES];
+#endif
 } stcp_send_ctrl_blk;
-/* ADD ANY EXTRA FUNCTIONS HERE */
 
+/*
+ * Pool buffers hold a copied segment, a handshake packet or a receive
+ * buffer, for an MTU of at most mtu.
+ */
+#define STCP_POOL_BLOCK(mtu) max(sizeof(segment) + (mtu) - sizeof(tcpheader), \
+                                 sizeof(packet) + max(mtu, STCP_MTU))
+
+/* The net effect of the ACKs drained from the socket in one pass */
 typedef struct {
-    stcp_send_ctrl_blk* cb;
-    unsigned char* data;
-    unsigned int length;
-    unsigned int seq;
-    unsigned int ack;
-} thread_data;
+    int valid;
+    unsigned int ackNo;         /* highest cumulative ACK seen */
+    unsigned int windowSize;    /* window advertised alongside ackNo */
+    int dups;                   /* of those, duplicates of the one before */
+#ifdef STCP_HISTOGRAMS
+    uint64_t readNs;            /* nowNs() when the batch was read */
+#endif
+} ackBatch;
+/* ADD ANY EXTRA FUNCTIONS HERE */
 
 
 /**
  * Validate the checksum of a packet
  * 
- * @param pkt The packet to calculate checksum for in host byte order
+ * @param data The packet as received, still in network byte order
+ * @param len The length of the packet
  * 
- * @return The calculated checksum, or -1 if the checksum is invalid
+ * @return 1 if the checksum is valid, 0 otherwise
  */
-int validateChecksum(packet *pkt) {
-  unsigned short checksum = ipchecksum(pkt->data, pkt->len);
-  if (checksum != 0) return checksum;
-  return 1;
+int validateChecksum(unsigned char *data, int len) {
+  return ipchecksum(data, len) == 0;
 }
 
 /**
@@ -88,153 +205,753 @@ void parsePacket(packet* pkt, unsigned char *data, int len) {
   ntohHdr(pkt->hdr);
 }
 
-void initilizePacket(packet *pkt, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, unsigned char *data, int len) {
-  unsigned char *buffer = calloc(1, len + sizeof(tcpheader));
-  memcpy(buffer + sizeof(tcpheader), data, len);
-
-  createSegment(pkt, flags, rwnd, seq, ack, buffer, len);
+static void queuePush(segmentQueue *q, segment *seg) {
+    seg->next = NULL;
+    if (q->tail) q->tail->next = seg;
+    else q->head = seg;
+    q->tail = seg;
+    q->bytes += seg->length;
 }
 
-void* stcp_send_segment(void* arg) {
-    // Cast the argument to the correct type
-    stcp_send_ctrl_blk* cb = ((thread_data*)arg)->cb;
-    unsigned char* data = ((thread_data*)arg)->data;
-    unsigned int length = ((thread_data*)arg)->length;
-    unsigned int seq = ((thread_data*)arg)->seq;
-    unsigned int ack = ((thread_data*)arg)->ack;
+static segment *queuePop(segmentQueue *q) {
+    segment *seg = q->head;
+    if (seg == NULL) return NULL;
+    q->head = seg->next;
+    if (q->head == NULL) q->tail = NULL;
+    q->bytes -= seg->length;
+    return seg;
+}
 
-    int fd = cb->fd;
+static void queueFree(pktPool *pool, segmentQueue *q) {
+    segment *seg;
+    while ((seg = queuePop(q)) != NULL) poolFree(pool, seg);
+}
 
-    // Allocate and copy data
-    packet *pkt = calloc(1, sizeof(packet));
-    packet *pktRcv = calloc(1, sizeof(packet));
-    unsigned char *buffer = calloc(1, sizeof(tcpheader));
-    if (!pkt || !pktRcv || !buffer) {
+/**
+ * Build a data segment carrying the next length bytes of the stream
+ *
+ * @param cb The control block; cb->seq is the segment's sequence number
+ * @param data The payload of the segment
+ * @param length The payload length, at most cb->mss
+ * @param copy Nonzero to copy the payload into the segment, zero to send
+ *             it from data, which must then outlive the segment
+ *
+ * @return The segment ready for transmission, or NULL if out of memory
+ */
+static segment *newSegment(stcp_send_ctrl_blk *cb, unsigned char *data, int length, int copy) {
+    histStamp(start);
+    segment *seg = poolAlloc(&cb->pool);
+    if (seg == NULL) {
         logLog("failure", "Memory allocation failed");
-        free(pkt);
-        free(pktRcv);
-        free(buffer);
-        free(arg);
         return NULL;
     }
+    /* Only the fields ahead of the header need zeroing; the payload is overwritten */
+    memset(seg, 0, offsetof(segment, hdr));
+    seg->seq = cb->seq;
+    seg->length = length;
+    seg->payload = copy ? memcpy(seg->data, data, length) : data;
+    seg->queuedAt = now();
+
+    /* The checksum waits for the first transmission, as small writes may still grow the payload */
+    createHeader(&seg->hdr, ACK, STCP_MAXWIN, cb->seq, cb->ack);
+    htonHdr(&seg->hdr);
+    histElapsed(seg->buildNs, start);
+    return seg;
+}
 
-    pthread_cleanup_push(free, pkt);
-    pthread_cleanup_push(free, pktRcv);
-    pthread_cleanup_push(free, buffer);
-    pthread_cleanup_push(free, arg);
+/**
+ * Arm the retransmission timer to fire after ms milliseconds, or disarm it
+ * when ms is negative.
+ */
+static void setTimer(stcp_send_ctrl_blk *cb, long ms) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (ms >= 0) {
+        its.it_value.tv_sec = ms / 1000;
+        its.it_value.tv_nsec = (ms % 1000) * 1000000;
+        /* A zero it_value disarms the timer; expire as soon as possible instead */
+        if (ms == 0) its.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime(cb->timerfd, 0, &its, NULL) < 0) {
+        logPerror("timerfd_settime");
+    }
+}
 
-    // Prepare the segment and set fields
-    pthread_mutex_lock(cb->logicLock);
-    initilizePacket(pkt, ACK, STCP_MAXWIN, seq, ack, data, length);
-    pthread_mutex_unlock(cb->logicLock);
+/*
+ * Arm the timerfd for the wheel's next expiry. The timerfd is only
+ * reprogrammed when that expiry changes, so scheduling and cancelling
+ * segment timers costs no system calls.
+ */
+static void syncTimer(stcp_send_ctrl_blk *cb) {
+    long next = twNextExpiry(&cb->wheel);
+    if (next == cb->timerfdExpiry) return;
 
-    // Display packet details for debugging
-    dump('s', pkt, pkt->len);
+    cb->timerfdExpiry = next;
+    setTimer(cb, next < 0 ? -1 : max(next - now(), 0));
+}
 
-    // Convert header fields to network byte order afterward
-    htonHdr(pkt->hdr);
-    pkt->hdr->checksum = ipchecksum(pkt->data, pkt->len);
+/*
+ * Send every transmission queued since the last flush. Segments must not
+ * be freed while they sit in the batch, so each event handler flushes
+ * before returning.
+ *
+ * Returns STCP_SUCCESS, or STCP_ERROR if the socket failed permanently
+ */
+static int flushOutput(stcp_send_ctrl_blk *cb) {
+    if (cb->txBatch.count == 0) return STCP_SUCCESS;
 
-    int timeout = STCP_INITIAL_TIMEOUT;
-    int sent = 0;
+    histStamp(start);
+    int res = writeBatch(cb->fd, &cb->txBatch);
+    histSince(&cb->hist[STCP_HIST_SEND], start);
+    return res == STCP_READ_PERMANENT_FAILURE ? STCP_ERROR : STCP_SUCCESS;
+}
 
-    while (1) {
-        pthread_mutex_lock(cb->logicLock);
+/**
+ * Queue a segment's wire image for transmission
+ *
+ * @return STCP_SUCCESS, or STCP_ERROR if the socket failed permanently
+ */
+static int transmitSegment(stcp_send_ctrl_blk *cb, segment *seg) {
+    if (dumpOn()) {
+        tcpheader hdr = seg->hdr;
+        ntohHdr(&hdr);
+        dump('s', &hdr, sizeof(tcpheader) + seg->length);
+    }
 
-        // Wait for previous packets to finish
-        while (greater32(seq, cb->windowPos)) {
-            pthread_mutex_unlock(cb->logicLock);
-            sched_yield(); // Allow other threads to execute
-            pthread_mutex_lock(cb->logicLock);
-        }
+    seg->sentNs = nowNs();
+    statsAdd(cb->stats.segmentsSent, 1);
+    statsAdd(cb->stats.bytesSent, seg->length);
+    if (seg->transmissions++ > 0) {
+        traceLog("failure", TRACE_RETRANSMIT, 0, seg->seq, cb->windowStart, seg->length, cb->cc.cwnd);
+        statsAdd(cb->stats.retransmits, 1);
+    }
+    twSchedule(&cb->wheel, &seg->timer, seg->sentNs / 1000000 + seg->timeout);
 
-        // Wait for window to move
-        unsigned int currWindowPos = minus32(seq, cb->windowStart);
-        while (greater32(currWindowPos, cb->windowSize)) {
-            pthread_mutex_unlock(cb->logicLock);
-            sched_yield(); // Allow other threads to execute
-            pthread_mutex_lock(cb->logicLock);
-        }
+    batchAdd(&cb->txBatch, &seg->hdr, sizeof(tcpheader), seg->payload, seg->length);
+    if (batchFull(&cb->txBatch)) return flushOutput(cb);
+    return STCP_SUCCESS;
+}
 
-        pthread_mutex_unlock(cb->logicLock);
+/*
+ * Move the segment at the head of the send queue into flight.
+ */
+static int transmitNext(stcp_send_ctrl_blk *cb) {
+    segment *seg = queuePop(&cb->sendQueue);
+
+    queuePush(&cb->retransQueue, seg);
+    cb->windowPos = plus32(seg->seq, seg->length);
+    twCancel(&cb->wheel, &cb->persistTimer);
+    seg->timeout = cb->rto;
+    seg->sacked = 0;
+    seg->lossEpoch = 0;
+
+    histStamp(start);
+    seg->hdr.checksum = ipchecksumSplit(&seg->hdr, sizeof(tcpheader), seg->payload, seg->length);
+    histAdd(&cb->hist[STCP_HIST_BUILD], seg->buildNs + nowNs() - start);
+    return transmitSegment(cb, seg);
+}
 
-        logLog("info", "Sending packet with seq %u", seq);
+/*
+ * The current pacing rate in bytes per millisecond, or 0 if segments go
+ * out unpaced. Until there is an RTT estimate there is nothing to spread
+ * the window over.
+ */
+static long pacingRate(stcp_send_ctrl_blk *cb) {
+    long rate;
+
+    if (cb->paceRate == STCP_PACING_OFF) return 0;
+    if (cb->paceRate > 0) {
+        rate = cb->paceRate / 1000;
+    } else {
+        if (!cb->rttValid) return 0;
+        long gain = cb->cc.cwnd < cb->cc.ssthresh ? STCP_PACE_GAIN_SS : STCP_PACE_GAIN_CA;
+        rate = (long) cb->cc.cwnd * gain * 10 / (cb->srtt > 0 ? cb->srtt : 1);
+    }
+    return rate > 0 ? rate : 1;
+}
 
-        // If the desired ACK has already been received, exit
-        pthread_mutex_lock(cb->logicLock);
-        if (greater32(cb->latestAck, seq + length) || cb->latestAck == seq + length) {
-            logLog("success", "Received CUMUL ACK from receiver! Wanted Ack: %u :: Latest Ack: %u", seq + length, cb->latestAck);
-            pthread_mutex_unlock(cb->logicLock);
-            break;
-        }
-        pthread_mutex_unlock(cb->logicLock);
-
-        // Send the packet
-        pthread_mutex_lock(cb->fileLock);
-        write(fd, pkt, pkt->len);
-        pthread_mutex_unlock(cb->fileLock);
-
-        // Mark the packet as sent
-        if (!sent) {
-            pthread_mutex_lock(cb->logicLock);
-            cb->windowPos = plus32(seq, length);
-            pthread_mutex_unlock(cb->logicLock);
-            sent = 1;
-        }
+/*
+ * Take length bytes from the pacing token bucket. The bucket fills at the
+ * pacing rate and holds one millisecond's worth, the resolution of the
+ * timer wheel, but never less than two segments.
+ *
+ * Returns 1 if the segment may go now. Otherwise the pacing timer is
+ * set for when it may, and 0 is returned.
+ */
+static int paceAllows(stcp_send_ctrl_blk *cb, int length) {
+    long rate = pacingRate(cb);
+    if (rate == 0) return 1;
+
+    long time = now();
+    long elapsed = time - cb->paceStamp;
+    long burst = rate > 2 * cb->mss ? rate : 2 * cb->mss;
+
+    if (elapsed > burst / rate) {
+        cb->paceTokens = burst;
+    } else if (cb->paceTokens + rate * elapsed < burst) {
+        cb->paceTokens += rate * elapsed;
+    } else {
+        cb->paceTokens = burst;
+    }
+    cb->paceStamp = time;
+    if (cb->paceTokens >= length) {
+        cb->paceTokens -= length;
+        return 1;
+    }
 
-        // Wait for ACK
-        int lenRcv = readWithTimeout(fd, buffer, timeout);
-        timeout = stcpNextTimeout(timeout); // Update timeout value
+    if (!twPending(&cb->paceTimer)) {
+        twSchedule(&cb->wheel, &cb->paceTimer, time + (length - cb->paceTokens + rate - 1) / rate);
+    }
+    return 0;
+}
 
-        if (lenRcv == STCP_READ_TIMED_OUT) {
-            logLog("failure", "Timed out waiting for ACK %u", seq + length);
-            continue;
-        }
+/*
+ * Whether to keep back the segment at the tail of the send queue so that
+ * later stcp_send() calls can fill it. Only a short tail holding a copy
+ * can still grow, and none is held past coalesceDelay or once it has
+ * been flushed. If it
+ * is held, the coalescing timer wakes the loop when its delay is up.
+ */
+static int coalesceHolds(stcp_send_ctrl_blk *cb, segment *seg) {
+    if (seg != cb->sendQueue.tail || seg->length >= cb->mss || cb->coalesce == STCP_NODELAY) return 0;
+    if (seg->payload != seg->data) return 0;
+    if (greater32(cb->pushSeq, seg->seq)) return 0;
+    if (cb->coalesce == STCP_NAGLE && cb->retransQueue.head == NULL) return 0;
+
+    long deadline = seg->queuedAt + cb->coalesceDelay;
+    if (deadline <= now()) return 0;
+    if (!twPending(&cb->coalesceTimer)) twSchedule(&cb->wheel, &cb->coalesceTimer, deadline);
+    return 1;
+}
 
-        // Process received packet
-        parsePacket(pktRcv, buffer, lenRcv);
-        tcpheader* hdrRcv = pktRcv->hdr;
+/*
+ * Whether a segment in flight that the receiver has not SACKed counts as
+ * lost. After a timeout every one sent before it does. In fast recovery
+ * those with SACKed data above them do, or without SACK only the one at
+ * windowStart, as in NewReno.
+ */
+static int segmentLost(stcp_send_ctrl_blk *cb, segment *seg) {
+    if (seg->sacked) return 0;
+    if (cb->caState == STCP_CA_LOSS) return greater32(cb->recover, seg->seq);
+    if (!cb->sackOk) return cb->caState == STCP_CA_RECOVERY && seg == cb->retransQueue.head;
+    return !greater32(plus32(seg->seq, seg->length), cb->highSacked);
+}
+
+/*
+ * The bytes still in the network, after RFC 6675: everything in flight
+ * that is neither SACKed nor lost, plus the lost segments already resent
+ * in this recovery. Without SACK each duplicate ACK stands for a segment
+ * that has left the network.
+ */
+static unsigned int pipeBytes(stcp_send_ctrl_blk *cb) {
+    unsigned int pipe = 0;
+    unsigned int left = cb->sackOk ? 0 : cb->dupAcks * cb->mss;
 
-        pthread_mutex_lock(cb->logicLock);
-        dump('r', pktRcv, pktRcv->len);
+    for (segment *seg = cb->retransQueue.head; seg; seg = seg->next) {
+        if (!seg->sacked && (!segmentLost(cb, seg) || seg->lossEpoch == cb->lossEpoch)) pipe += seg->length;
+    }
+    return pipe > left ? pipe - left : 0;
+}
 
-        // Verify checksum
-        if (!validateChecksum(pktRcv)) {
-            logLog("failure", "Invalid checksum");
-            pthread_mutex_unlock(cb->logicLock);
-            continue;
+/*
+ * Move queued segments into flight for as long as they fit in both the
+ * receiver's advertised window and the congestion window, no faster than
+ * the pacing rate, and unless coalesceHolds() keeps a short one back.
+ *
+ * The first two duplicate ACKs each let one more segment past the
+ * congestion window (limited transmit, RFC 3042), so a small window
+ * still draws enough of them for a fast retransmit. During a recovery
+ * new data goes out while pipeBytes() leaves room in the congestion
+ * window, after the lost segments have been resent.
+ *
+ * If the window is too small for the next segment and nothing is in
+ * flight, no ACK is coming to reopen it. The loop then sleeps on the
+ * persist timer, and handleTimeout() sends that segment as a window
+ * probe when the timer fires.
+ */
+static int transmitReady(stcp_send_ctrl_blk *cb) {
+    unsigned int windowEnd = plus32(cb->windowStart, cb->windowSize);
+    unsigned int cwndEnd = plus32(cb->windowStart, cb->cc.cwnd + min(cb->dupAcks, 2) * cb->mss);
+    unsigned int pipe = cb->caState == STCP_CA_OPEN ? 0 : pipeBytes(cb);
+
+    while (cb->sendQueue.head) {
+        segment *seg = cb->sendQueue.head;
+        if (greater32(plus32(seg->seq, seg->length), windowEnd)) break;
+        if (cb->caState == STCP_CA_OPEN ? greater32(plus32(seg->seq, seg->length), cwndEnd)
+                                        : pipe + seg->length > cb->cc.cwnd) break;
+        if (coalesceHolds(cb, seg)) return STCP_SUCCESS;
+        if (!paceAllows(cb, seg->length)) return STCP_SUCCESS;
+        pipe += seg->length;
+        if (transmitNext(cb) == STCP_ERROR) return STCP_ERROR;
+    }
+
+    if (cb->sendQueue.head && cb->retransQueue.head == NULL && !twPending(&cb->persistTimer)) {
+        logLog("info", "Window of %u bytes closed, waiting to probe", cb->windowSize);
+        twSchedule(&cb->wheel, &cb->persistTimer, now() + cb->persistTimeout);
+    }
+    return STCP_SUCCESS;
+}
+
+/*
+ * Feed one round-trip sample, in microseconds, into the smoothed
+ * estimator of RFC 6298 and recompute the retransmission timeout.
+ */
+static void rttSample(stcp_send_ctrl_blk *cb, long sample) {
+    if (!cb->rttValid) {
+        cb->srtt = sample;
+        cb->rttvar = sample / 2;
+        cb->rttValid = 1;
+    } else {
+        long err = sample - cb->srtt;
+        cb->srtt += err / 8;
+        cb->rttvar += (labs(err) - cb->rttvar) / 4;
+    }
+
+    long variance = 4 * cb->rttvar;
+    if (variance < STCP_CLOCK_GRANULARITY) variance = STCP_CLOCK_GRANULARITY;
+    long rto = (cb->srtt + variance + 999) / 1000;
+    cb->rto = max(cb->rtoMin, min(cb->rtoMax, rto));
+    logLog("debug", "RTT sample %ld us, srtt %ld us, rttvar %ld us, rto %d ms",
+           sample, cb->srtt, cb->rttvar, cb->rto);
+    histAdd(&cb->hist[STCP_HIST_RTT], sample * 1000);
+}
+
+/*
+ * Double a timeout after an expiry, up to the configured ceiling.
+ */
+static int backoffTimeout(stcp_send_ctrl_blk *cb, int timeout) {
+    return min(cb->rtoMax, timeout * 2);
+}
+
+/*
+ * Drop every segment that the cumulative ACK in cb->windowStart covers.
+ *
+ * Returns the round-trip time in microseconds of the most recently sent
+ * of those segments, or -1 if none can be timed. Per Karn's algorithm an
+ * ACK for a retransmitted segment is ambiguous and is never sampled, and
+ * neither is a segment sent before the latest retransmission: its ACK
+ * may have been held back behind the hole that retransmission filled.
+ */
+static long releaseAcked(stcp_send_ctrl_blk *cb) {
+    segment *seg;
+    long sample = -1;
+    while ((seg = cb->retransQueue.head) != NULL &&
+           !greater32(plus32(seg->seq, seg->length), cb->windowStart)) {
+        if (seg->transmissions == 1 && !greater32(cb->sampleFrom, seg->seq)) {
+            sample = (nowNs() - seg->sentNs) / 1000;
         }
+        twCancel(&cb->wheel, &seg->timer);
+        poolFree(&cb->pool, queuePop(&cb->retransQueue));
+    }
+    if (greater32(cb->windowStart, cb->highSacked)) cb->highSacked = cb->windowStart;
+    return sample;
+}
 
-        // Verify ACK
-        if (hdrRcv->flags != ACK || hdrRcv->ackNo <= seq) {
-            logLog("failure", "Invalid ACK: Received %u, Expected %u", hdrRcv->ackNo, seq + length);
-            pthread_mutex_unlock(cb->logicLock);
-            continue;
+/*
+ * Mark the segments in flight that the SACK blocks of an ACK cover. The
+ * receiver holds those, so they are never resent as holes. Blocks that
+ * do not lie wholly inside the window are stale and ignored.
+ */
+static void sackMark(stcp_send_ctrl_blk *cb, tcpoptions *opts) {
+    for (int i = 0; i < opts->sackBlocks; i++) {
+        unsigned int start = opts->sack[i][0];
+        unsigned int end = opts->sack[i][1];
+
+        if (greater32(cb->windowStart, start) || greater32(end, cb->windowPos) ||
+            !greater32(end, start)) continue;
+        for (segment *seg = cb->retransQueue.head; seg && greater32(end, seg->seq); seg = seg->next) {
+            unsigned int segEnd = plus32(seg->seq, seg->length);
+            if (seg->sacked || greater32(start, seg->seq) || greater32(segEnd, end)) continue;
+            seg->sacked = 1;
+            if (greater32(segEnd, cb->highSacked)) cb->highSacked = segEnd;
         }
+    }
+}
+
+/**
+ * Fold one received packet into a batch of ACKs
+ *
+ * @param batch The ACKs drained so far in this batch
+ * @param buf The packet as received, in network byte order
+ * @param len The length of the packet
+ *
+ * @return STCP_SUCCESS, or STCP_ERROR if the receiver reset the connection
+ */
+static int collectAck(stcp_send_ctrl_blk *cb, ackBatch *batch, unsigned char *buf, int len) {
+    tcpheader ackHdr;
+    tcpheader *hdr = &ackHdr;
+
+    if (len < (int) sizeof(tcpheader) || !validateChecksum(buf, len)) {
+        logLog("failure", "Invalid checksum");
+        statsAdd(cb->stats.badChecksums, 1);
+        return STCP_SUCCESS;
+    }
+    memcpy(hdr, buf, sizeof(tcpheader));
+    ntohHdr(hdr);
+
+    if (getRst(hdr)) {
+        logLog("failure", "Connection reset by receiver");
+        return STCP_ERROR;
+    }
+    /* A resent SYN-ACK acknowledges no data */
+    if (!getAck(hdr) || getSyn(hdr)) return STCP_SUCCESS;
+    statsAdd(cb->stats.acksReceived, 1);
+
+    if (greater32(hdr->ackNo, cb->windowPos)) {
+        logLog("failure", "Invalid ACK: Received %u, never sent past %u", hdr->ackNo, cb->windowPos);
+        return STCP_SUCCESS;
+    }
+    if (greater32(cb->windowStart, hdr->ackNo)) return STCP_SUCCESS;
+
+    if (cb->sackOk && tcpHeaderLength(hdr, len) > (int) sizeof(tcpheader)) {
+        tcpoptions opts;
+        if (tcpParseOptions(buf, len, &opts) == 0) sackMark(cb, &opts);
+    }
 
-        // Update control block with latest ACK info
-        cb->windowStart = hdrRcv->ackNo;
-        if (greater32(hdrRcv->ackNo, cb->latestAck)) {
-            cb->latestAck = hdrRcv->ackNo;
-            cb->windowSize = hdrRcv->windowSize;
+    /*
+     * Later ACKs for the same byte carry the fresher window. Per RFC 5681
+     * one only counts as a duplicate if it carries no data and leaves the
+     * window as it was, so window updates never look like losses.
+     */
+    unsigned int window = (unsigned int) hdr->windowSize << cb->windowShift;
+    int pure = tcpHeaderLength(hdr, len) == len;
+    if (!batch->valid || greater32(hdr->ackNo, batch->ackNo)) {
+        batch->valid = 1;
+        batch->ackNo = hdr->ackNo;
+        batch->dups = hdr->ackNo == cb->windowStart && pure && window == cb->windowSize;
+    } else if (hdr->ackNo == batch->ackNo) {
+        batch->dups += pure && window == batch->windowSize;
+    } else {
+        return STCP_SUCCESS;
+    }
+    batch->windowSize = window;
+    return STCP_SUCCESS;
+}
+
+/*
+ * Resend the lost segments, oldest first, each once per recovery, while
+ * pipeBytes() leaves room for them in the congestion window. After a
+ * timeout that is every segment sent before it, so the window slow
+ * starts through them instead of waiting out a timer for each.
+ */
+static int lossRetransmit(stcp_send_ctrl_blk *cb) {
+    unsigned int pipe = pipeBytes(cb);
+
+    for (segment *seg = cb->retransQueue.head; seg; seg = seg->next) {
+        if (cb->caState == STCP_CA_LOSS ? !greater32(cb->recover, seg->seq)
+                                        : !greater32(cb->highSacked, seg->seq)) break;
+        if (!segmentLost(cb, seg) || seg->lossEpoch == cb->lossEpoch) continue;
+        if (pipe + seg->length > cb->cc.cwnd) break;
+
+        logLog("failure", "Lost segment, retransmitting %u", seg->seq);
+        pipe += seg->length;
+        seg->lossEpoch = cb->lossEpoch;
+        cb->sampleFrom = cb->windowPos;
+        if (transmitSegment(cb, seg) == STCP_ERROR) return STCP_ERROR;
+    }
+    return STCP_SUCCESS;
+}
+
+/*
+ * Resend the segment at windowStart without waiting for its timer. Like a
+ * timeout this backs the timer off. New data still goes out as far as
+ * pipeBytes() allows, so the duplicate ACKs it draws keep the ACK clock
+ * running through the recovery.
+ */
+static int fastRetransmit(stcp_send_ctrl_blk *cb) {
+    segment *hole = cb->retransQueue.head;
+
+    logLog("failure", "Fast retransmit after %d duplicate ACKs for %u", cb->dupAcks, hole->seq);
+    statsAdd(cb->stats.fastRetransmits, 1);
+
+    /* Only one reduction for the losses out of a single window */
+    if (cb->caState == STCP_CA_OPEN || !greater32(cb->recover, hole->seq)) {
+        cb->ccOps->onLoss(&cb->cc, minus32(cb->windowPos, cb->windowStart), now());
+        cb->caState = STCP_CA_RECOVERY;
+        cb->recover = cb->windowPos;
+        cb->lossEpoch++;
+        logLog("debug", "Loss: cwnd %u, ssthresh %u", cb->cc.cwnd, cb->cc.ssthresh);
+    }
+    cb->fastRecovery = 1;
+    hole->timeout = backoffTimeout(cb, hole->timeout);
+    hole->lossEpoch = cb->lossEpoch;
+    cb->sampleFrom = cb->windowPos;
+    if (transmitSegment(cb, hole) == STCP_ERROR) return STCP_ERROR;
+    return lossRetransmit(cb);
+}
+
+/*
+ * An ACK moved windowStart forward but not past cb->recover, so the
+ * segment now at windowStart was lost along with the one just repaired
+ * (NewReno). Resend it straight away, without another reduction of the
+ * congestion window. With SACK that is skipped if the hole was resent
+ * already in this recovery. The other lost segments follow.
+ */
+static int partialAck(stcp_send_ctrl_blk *cb) {
+    segment *hole = cb->retransQueue.head;
+
+    cb->fastRecovery = 1;
+    cb->dupAcks = 0;
+    if (hole->lossEpoch != cb->lossEpoch) {
+        logLog("failure", "Partial ACK, retransmitting %u", hole->seq);
+        hole->lossEpoch = cb->lossEpoch;
+        cb->sampleFrom = cb->windowPos;
+        if (transmitSegment(cb, hole) == STCP_ERROR) return STCP_ERROR;
+    }
+    return lossRetransmit(cb);
+}
+
+/*
+ * Apply the highest cumulative ACK of a batch to the control block.
+ */
+static int applyAcks(stcp_send_ctrl_blk *cb, ackBatch *batch) {
+    if (!batch->valid) return STCP_SUCCESS;
+
+    cb->windowSize = batch->windowSize;
+    if (greater32(batch->ackNo, cb->windowStart)) {
+        unsigned int acked = minus32(batch->ackNo, cb->windowStart);
+
+        logLog("success", "Valid ACK received! Ack: %u", batch->ackNo);
+        cb->windowStart = batch->ackNo;
+        cb->latestAck = batch->ackNo;
+        cb->dupAcks = batch->dups;
+        cb->fastRecovery = 0;
+        statsAdd(cb->stats.bytesAcked, acked);
+        statsAdd(cb->stats.dupAcks, batch->dups);
+        long sample = releaseAcked(cb);
+        histSince(&cb->hist[STCP_HIST_RELEASE], batch->readNs);
+        if (sample >= 0) rttSample(cb, sample);
+        cb->persistTimeout = cb->rto;
+
+        /* cwnd stays put during fast recovery, but slow starts again after a timeout */
+        int partial = cb->caState != STCP_CA_OPEN && greater32(cb->recover, cb->windowStart);
+        if (!partial) cb->caState = STCP_CA_OPEN;
+        if (cb->caState != STCP_CA_RECOVERY) cb->ccOps->onAck(&cb->cc, acked, now());
+        if (partial && cb->retransQueue.head) return partialAck(cb);
+    } else if (cb->retransQueue.head) {
+        cb->dupAcks += batch->dups;
+        statsAdd(cb->stats.dupAcks, batch->dups);
+    }
+
+    /* Duplicates that arrive during recovery never start another one */
+    segment *hole = cb->retransQueue.head;
+    if (hole && hole->seq == cb->windowStart && !cb->fastRecovery &&
+        cb->dupAcks >= STCP_DUP_ACK_THRESHOLD) {
+        return fastRetransmit(cb);
+    }
+
+    /* Fresh SACK blocks, or a window grown since a timeout, may let more lost segments go */
+    if (cb->caState != STCP_CA_OPEN) return lossRetransmit(cb);
+    return STCP_SUCCESS;
+}
+
+/*
+ * The socket is readable: drain every queued ACK, then update the window
+ * once for the whole batch. This is the only place the data transfer
+ * phase reads from the socket.
+ */
+static int handleInput(stcp_send_ctrl_blk *cb) {
+    unsigned char bufs[STCP_IO_BATCH][STCP_MTU];
+    int lens[STCP_IO_BATCH];
+    ackBatch batch;
+    int n = STCP_IO_BATCH;
+
+    memset(&batch, 0, sizeof(batch));
+    for (int total = 0; n == STCP_IO_BATCH && total < STCP_MAX_ACK_BATCH; total += n) {
+        n = readBatch(cb->fd, bufs[0], STCP_MTU, lens, NULL, STCP_IO_BATCH);
+
+        if (n == STCP_READ_PERMANENT_FAILURE) return STCP_ERROR;
+        if (n == STCP_READ_TIMED_OUT) break;
+        if (total == 0) histMark(batch.readNs);
+        for (int i = 0; i < n; i++) {
+            if (collectAck(cb, &batch, bufs[i], lens[i]) == STCP_ERROR) return STCP_ERROR;
         }
+    }
+    if (applyAcks(cb, &batch) == STCP_ERROR) return STCP_ERROR;
+    return flushOutput(cb);
+}
 
-        pthread_mutex_unlock(cb->logicLock);
-        logLog("success", "Valid ACK received! Seq: %u :: Ack: %u", hdrRcv->seqNo, hdrRcv->ackNo);
-        break;
+/*
+ * A segment's retransmission timer expired: resend it and back off.
+ *
+ * Only the oldest segment's timer counts as a retransmission timeout.
+ * The rest were sent later, so they only expire because the oldest is
+ * holding them up; resending them all at once would flood the path just
+ * as the congestion window collapses. Their timers are pushed back. If
+ * one is a loss not yet repaired in this recovery, lossRetransmit() gets
+ * a chance at it without waiting for an ACK.
+ */
+static int segmentExpired(stcp_send_ctrl_blk *cb, segment *seg) {
+    if (seg != cb->retransQueue.head) {
+        twSchedule(&cb->wheel, &seg->timer, now() + seg->timeout);
+        if (segmentLost(cb, seg) && seg->lossEpoch != cb->lossEpoch) return lossRetransmit(cb);
+        return STCP_SUCCESS;
+    }
+
+    logLog("failure", "Timed out waiting for ACK %u", plus32(seg->seq, seg->length));
+    traceLog("failure", TRACE_TIMEOUT, 0, seg->seq, cb->windowStart, seg->timeout, cb->cc.cwnd);
+    statsAdd(cb->stats.timeouts, 1);
+    cb->ccOps->onTimeout(&cb->cc, minus32(cb->windowPos, cb->windowStart),
+                         cb->caState != STCP_CA_LOSS, now());
+    cb->caState = STCP_CA_LOSS;
+    cb->recover = cb->windowPos;
+    cb->lossEpoch++;
+    seg->lossEpoch = cb->lossEpoch;
+    logLog("debug", "Timeout: cwnd %u, ssthresh %u", cb->cc.cwnd, cb->cc.ssthresh);
+    seg->timeout = backoffTimeout(cb, seg->timeout);
+    cb->sampleFrom = cb->windowPos;
+    cb->dupAcks = 0;
+    return transmitSegment(cb, seg);
+}
+
+/*
+ * The persist timer expired with the window still too small for the
+ * next segment: send it anyway as a window probe.
+ */
+static int persistExpired(stcp_send_ctrl_blk *cb) {
+    if (cb->sendQueue.head == NULL || cb->retransQueue.head) return STCP_SUCCESS;
+
+    logLog("info", "Probing closed window of %u bytes", cb->windowSize);
+    cb->persistTimeout = backoffTimeout(cb, cb->persistTimeout);
+    return transmitNext(cb);
+}
+
+/*
+ * The timerfd fired: run every timer on the wheel that is now due.
+ */
+static int handleTimeout(stcp_send_ctrl_blk *cb) {
+    uint64_t expirations;
+    twTimer *t;
+
+    if (read(cb->timerfd, &expirations, sizeof(expirations)) < 0) return STCP_SUCCESS;
+    cb->timerfdExpiry = -1;
+
+    long time = now();
+    while ((t = twExpired(&cb->wheel, time)) != NULL) {
+        int res = STCP_SUCCESS;
+
+        /* The pacing and coalescing timers only wake the loop, transmitReady() does the rest */
+        if (t == &cb->persistTimer) res = persistExpired(cb);
+        else if (t != &cb->paceTimer && t != &cb->coalesceTimer) res = segmentExpired(cb, twEntry(t, segment, timer));
+        if (res == STCP_ERROR) return STCP_ERROR;
+    }
+    return flushOutput(cb);
+}
+
+/*
+ * Publish the connection's current values to its stats.
+ */
+static void statsSync(stcp_send_ctrl_blk *cb) {
+    statsSet(cb->stats.cwnd, cb->cc.cwnd);
+    statsSet(cb->stats.ssthresh, cb->cc.ssthresh);
+    statsSet(cb->stats.window, cb->windowSize);
+    statsSet(cb->stats.inFlight, minus32(cb->windowPos, cb->windowStart));
+    statsSet(cb->stats.queued, cb->sendQueue.bytes);
+    statsSet(cb->stats.srtt, cb->srtt);
+    statsSet(cb->stats.rto, cb->rto);
+}
+
+/*
+ * Run one iteration of the event loop: sleep until an ACK arrives or the
+ * retransmission timer fires, handle it, then send whatever the window
+ * now allows.
+ */
+static int stcpPoll(stcp_send_ctrl_blk *cb) {
+    struct epoll_event events[STCP_MAX_EVENTS];
+    int n = epoll_wait(cb->epfd, events, STCP_MAX_EVENTS, STCP_INFINITE_TIMEOUT);
+
+    if (n < 0) {
+        if (errno == EINTR) return STCP_SUCCESS;
+        logPerror("epoll_wait");
+        return STCP_ERROR;
+    }
+    for (int i = 0; i < n; i++) {
+        int res = events[i].data.fd == cb->fd ? handleInput(cb) : handleTimeout(cb);
+        if (res == STCP_ERROR) return STCP_ERROR;
     }
+    if (transmitReady(cb) == STCP_ERROR || flushOutput(cb) == STCP_ERROR) return STCP_ERROR;
+    syncTimer(cb);
+    statsSync(cb);
+    return STCP_SUCCESS;
+}
 
-    pthread_cleanup_pop(1); // Free pkt
-    pthread_cleanup_pop(1); // Free pktRcv
-    pthread_cleanup_pop(1); // Free buffer
-    pthread_cleanup_pop(1); // Free arg
+/*
+ * Create the epoll set and retransmission timer that drive the data
+ * transfer phase.
+ */
+static int stcpEngineInit(stcp_send_ctrl_blk *cb) {
+    struct epoll_event ev;
+
+    cb->epfd = epoll_create1(0);
+    cb->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (cb->epfd < 0 || cb->timerfd < 0) {
+        logPerror("stcpEngineInit");
+        return STCP_ERROR;
+    }
 
-    return NULL;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = cb->fd;
+    if (epoll_ctl(cb->epfd, EPOLL_CTL_ADD, cb->fd, &ev) < 0) {
+        logPerror("epoll_ctl");
+        return STCP_ERROR;
+    }
+    ev.data.fd = cb->timerfd;
+    if (epoll_ctl(cb->epfd, EPOLL_CTL_ADD, cb->timerfd, &ev) < 0) {
+        logPerror("epoll_ctl");
+        return STCP_ERROR;
+    }
+    twInit(&cb->wheel, now());
+    cb->timerfdExpiry = -1;
+#ifdef STCP_HISTOGRAMS
+    for (int i = 0; i < STCP_HIST_STAGES; i++) histInit(&cb->hist[i]);
+#endif
+    cb->persistTimeout = cb->rto;
+    cb->establishedNs = nowNs();
+    statsSync(cb);
+    return STCP_SUCCESS;
 }
 
 
 
 
+/*
+ * Cut length bytes of data into segments at the tail of the send queue,
+ * send what the window allows, and block while too much is queued.
+ * Copied data first tops up a short segment at the tail that has not
+ * been sent yet.
+ */
+static int queueData(stcp_send_ctrl_blk *cb, unsigned char *data, int length, int copy) {
+    segment *tail = cb->sendQueue.tail;
+
+    if (copy && tail && tail->payload == tail->data && tail->length < cb->mss) {
+        int chunk = min(length, cb->mss - tail->length);
+        memcpy(tail->data + tail->length, data, chunk);
+        tail->length += chunk;
+        cb->sendQueue.bytes += chunk;
+        cb->seq = plus32(cb->seq, chunk);
+        data += chunk;
+        length -= chunk;
+    }
+    while (length > 0) {
+        int chunk = min(length, cb->mss);
+        segment *seg = newSegment(cb, data, chunk, copy);
+        if (seg == NULL) return STCP_ERROR;
+
+        queuePush(&cb->sendQueue, seg);
+        cb->seq = plus32(cb->seq, chunk);
+        data += chunk;
+        length -= chunk;
+    }
+
+    if (transmitReady(cb) == STCP_ERROR || flushOutput(cb) == STCP_ERROR) return STCP_ERROR;
+    syncTimer(cb);
+    while (cb->sendQueue.bytes > STCP_SEND_BUFFER) {
+        if (stcpPoll(cb) == STCP_ERROR) return STCP_ERROR;
+    }
+    return STCP_SUCCESS;
+}
+
 /*
  * Send STCP. This routine is to send all the data (len bytes).  If more
  * than MSS bytes are to be sent, the routine breaks the data into multiple
@@ -248,33 +965,28 @@ void* stcp_send_segment(void* arg) {
  * function readWithTimeout() defined in stcp.c to receive segments) is done
  * as a side effect of the work of this function (and stcp_close()).
  *
+ * The data is copied into the send queue, so the caller may reuse its
+ * buffer as soon as this returns. The call only blocks while more than
+ * STCP_SEND_BUFFER bytes are queued behind a closed window.
+ *
  * The function returns STCP_SUCCESS on success, or STCP_ERROR on error.
  */
 int stcp_send(stcp_send_ctrl_blk *cb, unsigned char* data, int length) {
-  logLog("body", "(seq %i) '%s'", cb->seq, data);
-  // Allocate memory for the thread argument struct
-
-  unsigned int seq = cb->seq + 1;
-  unsigned int initSeq = cb->initSeq;
-  unsigned int index = ceil((minus32(seq, initSeq)) / STCP_MSS);
-
-  thread_data* send_arg = malloc(sizeof(thread_data));
-  send_arg->cb = cb;
-  send_arg->data = data;
-  send_arg->length = length;
-  send_arg->seq = cb->seq;
-  send_arg->ack = cb->ack;
-
-  cb->seq = plus32(cb->seq, length);
-  // cb->ack = plus32(cb->ack, 1);
-
-  // Create a new thread for sending the data
+    logLog("body", "(seq %u) %d bytes", cb->seq, length);
+    return queueData(cb, data, length, 1);
+}
 
-  logLog("thread", "Creating thread %d", index);
-  if (pthread_create(&(cb->threads[index]), NULL, stcp_send_segment, send_arg) != 0) {
-      logPerror("Error creating thread for sending data.");
-  }
-  return STCP_SUCCESS;
+/*
+ * Like stcp_send(), but the segments send their payload straight from
+ * data instead of a copy, and retransmissions read it again from there.
+ * data must stay mapped and unchanged until stcp_close() returns, which
+ * makes this the natural fit for a file mapped with mmap().
+ *
+ * The function returns STCP_SUCCESS on success, or STCP_ERROR on error.
+ */
+int stcp_send_mapped(stcp_send_ctrl_blk *cb, unsigned char* data, int length) {
+    logLog("body", "(seq %u) %d mapped bytes", cb->seq, length);
+    return queueData(cb, data, length, 0);
 }
 
 /*
@@ -291,8 +1003,12 @@ int stcp_send(stcp_send_ctrl_blk *cb, unsigned char* data, int length) {
  * number of "connections" to the number of file descriptors and isn't
  * very good for a pure request response protocol like DNS where there
  * is no long term relationship between the client and server.
+ *
+ * The SYN offers datagrams of up to mtu bytes. The connection uses the
+ * smaller of that and what the receiver's SYN-ACK offers back, or
+ * STCP_MTU if the receiver does not negotiate.
  */
-stcp_send_ctrl_blk * stcp_open(char *destination, int sendersPort, int receiversPort) {
+stcp_send_ctrl_blk * stcp_open_mtu(char *destination, int sendersPort, int receiversPort, int mtu) {
 
     logLog("init", "Sending from port %d to <%s, %d>", sendersPort, destination, receiversPort);
     int fd = udp_open(destination, receiversPort, sendersPort);
@@ -308,35 +1024,61 @@ stcp_send_ctrl_blk * stcp_open(char *destination, int sendersPort, int receivers
 
     // Initialize control block
     stcp_send_ctrl_blk *cb = calloc(1, sizeof(stcp_send_ctrl_blk));
+    mtu = max(STCP_MIN_MTU, min(STCP_MAX_MTU, mtu));
+    if (cb == NULL || poolInit(&cb->pool, STCP_POOL_BLOCK(mtu)) < 0) {
+        logLog("failure", "Memory allocation failed");
+        free(cb);
+        close(fd);
+        return NULL;
+    }
 
     cb->fd = fd;
+    cb->txBatch.gso = udpGsoSupported(fd);
     cb->windowSize = STCP_MAXWIN;
+    cb->rto = STCP_INITIAL_TIMEOUT;
+    cb->rtoMin = STCP_RTO_FLOOR;
+    cb->rtoMax = STCP_RTO_CEILING;
+    cb->ccOps = &STCP_DEFAULT_CC;
+    cb->coalesceDelay = STCP_COALESCE_DELAY;
 
     logLog("init", "Sending initial SYN pack to receiver");
 
-    // Initializing the SYN packet
-    packet *pktSent = calloc(1, sizeof(packet));
-    createSegment(pktSent, SYN, STCP_MAXWIN, 30, 0, NULL, 0);
+    /*
+     * Initializing the SYN packet, offering our MSS, window scaling and SACK as
+     * options. The sender never advertises a window that matters, so its
+     * own shift is 0; offering it lets the receiver scale its windows.
+     */
+    unsigned char options[TCP_MAX_OPTIONS];
+    tcpoptions offer = { .mss = mtu - sizeof(tcpheader), .hasWscale = 1, .wscale = 0, .sackPermitted = 1 };
+    int optLen = tcpWriteOptions(options, &offer);
+
+    packet *pktSent = poolAlloc(&cb->pool);
+    createSegment(pktSent, SYN, STCP_MAXWIN, 30, 0, options, optLen);
+    pktSent->hdr->dataOffset = pktSent->len / 4;
     
-    dump('s', pktSent, sizeof(tcpheader));
+    dump('s', pktSent->data, pktSent->len);
 
 
     htonHdr(pktSent->hdr);
-    pktSent->hdr->checksum = ipchecksum(pktSent->hdr, sizeof(tcpheader));
+    pktSent->hdr->checksum = ipchecksum(pktSent->data, pktSent->len);
 
     // Setup buffer to receive incoming packet
-    unsigned char *buf = calloc(1, STCP_MTU);
-    packet *pktRcv = calloc(1, sizeof(packet));
+    unsigned char *buf = poolAlloc(&cb->pool);
+    packet *pktRcv = poolAlloc(&cb->pool);
 
     int res;
     int timeout = STCP_INITIAL_TIMEOUT;
+    int synTransmissions = 0;
+    uint64_t synSentNs = 0;
 
     cb->state = STCP_SENDER_SYN_SENT;
 
     // Try to send the initial SYN packet
     while (cb->state == STCP_SENDER_SYN_SENT) {
       // Send the SYN packet
-      write(fd, pktSent, sizeof(tcpheader));
+      write(fd, pktSent->data, pktSent->len);
+      synSentNs = nowNs();
+      synTransmissions++;
 
 
 
@@ -350,53 +1092,187 @@ stcp_send_ctrl_blk * stcp_open(char *destination, int sendersPort, int receivers
         continue;
       } else if (res == STCP_READ_PERMANENT_FAILURE) {
         logPerror("Failed to read SYN-ACK from receiver");
-        return NULL;
+        break;
+      }
+
+      // Verify checksum
+      if (!validateChecksum(buf, res)) {
+        logLog("init", "Invalid checksum on SYN-ACK");
+        continue;
       }
 
       // Process the received packet
       parsePacket(pktRcv, buf, res);
       logLog("init", "Receiving SYN-ACK from receiver");
-      dump('r', pktRcv, pktRcv->len);
 
       tcpheader *hdrRcv = pktRcv->hdr;
 
-      // Verify checksum
-      int checksum = validateChecksum(pktRcv);
-      if (!checksum) {
-        logLog("init", "Invalid checksum -> Received %x but expected %x", checksum, hdrRcv->checksum);
-        continue;
-      }
-
       // Verify correct flags
         if (hdrRcv->flags != (ACK | SYN)) {
           logLog("init", "Invalid flags -> Received %x but expected %x", hdrRcv->flags, ACK | SYN);
           continue;
         }
 
+      // A receiver that does not negotiate sends no options back
+      tcpoptions peer;
+      tcpParseOptions(buf, res, &peer);
+      cb->mss = min(offer.mss, peer.mss > 0 ? peer.mss : STCP_MSS);
+      cb->windowShift = peer.hasWscale ? peer.wscale : 0;
+      cb->sackOk = peer.sackPermitted;
+      cb->ccOps->init(&cb->cc, cb->mss);
+
       // Initialize the control block
       logLog("success", "Received SYN-ACK from receiver. Syn: %u :: Ack: %u", hdrRcv->seqNo, hdrRcv->ackNo);
+      logLog("init", "Using an MSS of %d bytes and a window scale of %d%s", cb->mss, cb->windowShift,
+             cb->sackOk ? ", with SACK" : "");
       cb->state = STCP_SENDER_ESTABLISHED;
       cb->ack = (unsigned int) hdrRcv->seqNo + 1;
       cb->seq = hdrRcv->ackNo;
       cb->initSeq = hdrRcv->ackNo;
       cb->latestAck = hdrRcv->ackNo;
-      cb->windowSize = hdrRcv->windowSize;
+      cb->windowSize = hdrRcv->windowSize;    // never scaled on a SYN-ACK
       cb->windowStart = hdrRcv->ackNo;
       cb->windowPos = hdrRcv->ackNo;
+      cb->sampleFrom = hdrRcv->ackNo;
+      cb->highSacked = hdrRcv->ackNo;
+      cb->pushSeq = hdrRcv->ackNo;
+
+      // Seed the RTT estimate unless the SYN was retransmitted (Karn)
+      if (synTransmissions == 1) rttSample(cb, (nowNs() - synSentNs) / 1000);
       
       cb->state = STCP_SENDER_ESTABLISHED;
     }
 
     // Free memory and return control block
-    free(buf);
-    free(pktSent);
-    free(pktRcv);
-
+    poolFree(&cb->pool, buf);
+    poolFree(&cb->pool, pktSent);
+    poolFree(&cb->pool, pktRcv);
+
+    if (cb->state != STCP_SENDER_ESTABLISHED || stcpEngineInit(cb) == STCP_ERROR) {
+        poolDestroy(&cb->pool);
+        close(fd);
+        free(cb);
+        return NULL;
+    }
 
     return cb;
 }
 
 
+/*
+ * Open a connection offering the Ethernet MTU.
+ */
+stcp_send_ctrl_blk * stcp_open(char *destination, int sendersPort, int receiversPort) {
+    return stcp_open_mtu(destination, sendersPort, receiversPort, STCP_ETHERNET_MTU);
+}
+
+/*
+ * Set the bounds, in milliseconds, that the adaptive retransmission
+ * timeout is clamped to. The defaults are STCP_RTO_FLOOR and
+ * STCP_RTO_CEILING.
+ */
+void stcp_set_rto_bounds(stcp_send_ctrl_blk *cb, int floorMs, int ceilingMs) {
+    cb->rtoMin = max(1, floorMs);
+    cb->rtoMax = max(cb->rtoMin, ceilingMs);
+    cb->rto = max(cb->rtoMin, min(cb->rtoMax, cb->rto));
+}
+
+
+/*
+ * Switch the connection to the congestion control algorithm called name,
+ * "newreno" (the default) or "cubic". Call it before sending any data;
+ * the algorithm starts over from the initial window.
+ *
+ * Returns STCP_SUCCESS, or STCP_ERROR if there is no such algorithm.
+ */
+int stcp_set_congestion(stcp_send_ctrl_blk *cb, const char *name) {
+    const ccOps *ops = ccLookup(name);
+    if (ops == NULL) return STCP_ERROR;
+
+    cb->ccOps = ops;
+    cb->ccOps->init(&cb->cc, cb->mss);
+    logLog("init", "Using %s congestion control", ops->name);
+    return STCP_SUCCESS;
+}
+
+
+/*
+ * Pace transmissions at a fixed rate in bytes per second, or pass
+ * STCP_PACING_AUTO (the default) to pace at a gain times cwnd / srtt, or
+ * STCP_PACING_OFF to send as fast as the windows allow.
+ */
+void stcp_set_pacing(stcp_send_ctrl_blk *cb, long bytesPerSec) {
+    cb->paceRate = bytesPerSec < 0 ? STCP_PACING_OFF : bytesPerSec;
+}
+
+
+/*
+ * Choose how stcp_send() coalesces small writes into full segments:
+ * STCP_NAGLE (the default) holds back a short segment while earlier data
+ * is unacknowledged, STCP_CORK holds it back until it fills, and
+ * STCP_NODELAY sends it as soon as the windows allow. Either way none is
+ * held for more than delayMs (STCP_COALESCE_DELAY by default).
+ *
+ * Returns STCP_SUCCESS, or STCP_ERROR, changing nothing, if there is no
+ * such mode.
+ */
+int stcp_set_coalescing(stcp_send_ctrl_blk *cb, int mode, int delayMs) {
+    if (mode != STCP_NAGLE && mode != STCP_NODELAY && mode != STCP_CORK) return STCP_ERROR;
+
+    cb->coalesce = mode;
+    cb->coalesceDelay = max(0, delayMs);
+    return STCP_SUCCESS;
+}
+
+
+/*
+ * Send everything stcp_send() has been given so far as soon as the
+ * windows allow, short segment and all.
+ *
+ * Returns STCP_SUCCESS, or STCP_ERROR if the socket failed.
+ */
+int stcp_flush(stcp_send_ctrl_blk *cb) {
+    cb->pushSeq = cb->seq;
+    twCancel(&cb->wheel, &cb->coalesceTimer);
+    if (transmitReady(cb) == STCP_ERROR || flushOutput(cb) == STCP_ERROR) return STCP_ERROR;
+    syncTimer(cb);
+    return STCP_SUCCESS;
+}
+
+
+/*
+ * Fill in stats with a snapshot of the connection's counters. It may be
+ * called from any thread, even while another is blocked in stcp_send().
+ */
+void stcp_get_stats(stcp_send_ctrl_blk *cb, stcp_stats *stats) {
+    struct timespec ts;
+
+    statsSnapshot(stats, &cb->stats);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    stats->timeMs = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    stats->elapsedMs = (nowNs() - cb->establishedNs) / 1000000;
+    stats->goodput = stats->elapsedMs > 0 ? stats->bytesAcked * 1000 / stats->elapsedMs : 0;
+}
+
+static void statsSample(void *cb, stcp_stats *stats) {
+    stcp_get_stats(cb, stats);
+}
+
+/*
+ * Write the connection's stats out as a line of JSON every intervalMs
+ * (STATS_INTERVAL if 0) until stcp_close(), which writes the last one.
+ * target is a file, replaced each time, or "unix:" and the path of a
+ * Unix domain datagram socket to send each line to.
+ *
+ * Returns STCP_SUCCESS, or STCP_ERROR if the export could not be started.
+ */
+int stcp_export_stats(stcp_send_ctrl_blk *cb, const char *target, int intervalMs) {
+    if (cb->exporter != NULL) return STCP_ERROR;
+    cb->exporter = statsExportStart(target, intervalMs, statsSample, cb);
+    return cb->exporter != NULL ? STCP_SUCCESS : STCP_ERROR;
+}
+
+
 /*
  * Make sure all the outstanding data has been transmitted and
  * acknowledged, and then initiate closing the connection. This
@@ -409,15 +1285,29 @@ stcp_send_ctrl_blk * stcp_open(char *destination, int sendersPort, int receivers
 int stcp_close(stcp_send_ctrl_blk *cb) {
     /* YOUR CODE HERE */
 
+    // Drain the send and retransmission queues before closing
+    cb->state = STCP_SENDER_CLOSING;
+    if (stcp_flush(cb) == STCP_ERROR) return STCP_ERROR;
+    while (cb->sendQueue.head || cb->retransQueue.head) {
+        if (stcpPoll(cb) == STCP_ERROR) return STCP_ERROR;
+    }
+    setTimer(cb, -1);
+#ifdef STCP_HISTOGRAMS
+    histLog(&cb->hist[STCP_HIST_BUILD], "segment build");
+    histLog(&cb->hist[STCP_HIST_SEND], "send syscall");
+    histLog(&cb->hist[STCP_HIST_RELEASE], "ACK to release");
+    histLog(&cb->hist[STCP_HIST_RTT], "RTT");
+#endif
+
     // Send FIN packet to receiver
-    packet *pkt = calloc(1, sizeof(packet));
+    packet *pkt = poolAlloc(&cb->pool);
     createSegment(pkt, FIN, STCP_MAXWIN, cb->seq, cb->ack, NULL, 0);
     htonHdr(pkt->hdr);
     pkt->hdr->checksum = ipchecksum(pkt->data, pkt->len);
 
     // Setup buffer to receive incoming packet
-    unsigned char *buffer = calloc(1, sizeof(tcpheader));
-    packet *pktRcv = calloc(1, sizeof(packet));
+    unsigned char *buffer = poolAlloc(&cb->pool);
+    packet *pktRcv = poolAlloc(&cb->pool);
 
     int timeout = STCP_INITIAL_TIMEOUT;
 
@@ -428,7 +1318,7 @@ int stcp_close(stcp_send_ctrl_blk *cb) {
         logLog("finish", "Sending FIN packet to receiver");
 
         // Send the packet and await response
-        write(cb->fd, pkt, pkt->len);
+        write(cb->fd, pkt->data, pkt->len);
         int lenRcv = readWithTimeout(cb->fd, buffer, timeout);
         timeout = stcpNextTimeout(timeout);
 
@@ -440,17 +1330,16 @@ int stcp_close(stcp_send_ctrl_blk *cb) {
             return STCP_ERROR;
         }
 
-        // Process received packet
-        parsePacket(pktRcv, buffer, lenRcv);
-        tcpheader* hdrRcv = pktRcv->hdr;
-
         // Verify checksum
-        int checkSum = validateChecksum(pktRcv);
-        if (!checkSum) {
-            logLog("failure", "Invalid Checksum -> %x is not 0", checkSum);
+        if (!validateChecksum(buffer, lenRcv)) {
+            logLog("failure", "Invalid Checksum on FIN-ACK");
             continue;
         }
 
+        // Process received packet
+        parsePacket(pktRcv, buffer, lenRcv);
+        tcpheader* hdrRcv = pktRcv->hdr;
+
         // Additional ACK checks
         if (hdrRcv->flags != (ACK | FIN)) {
             logLog("failure", "Invalid flags -> Received %x but expected %x", hdrRcv->flags, ACK);
@@ -465,31 +1354,22 @@ int stcp_close(stcp_send_ctrl_blk *cb) {
         cb->state = STCP_SENDER_CLOSED;
     }
 
-    free(pkt);
-    free(buffer);
-    free(pktRcv);
-
-    pthread_mutex_destroy(cb->fileLock);
-    pthread_mutex_destroy(cb->logicLock);
-    
+    poolFree(&cb->pool, pkt);
+    poolFree(&cb->pool, buffer);
+    poolFree(&cb->pool, pktRcv);
+
+    statsSync(cb);
+    statsExportStop(cb->exporter);
+    queueFree(&cb->pool, &cb->sendQueue);
+    queueFree(&cb->pool, &cb->retransQueue);
+    poolDestroy(&cb->pool);
+    close(cb->timerfd);
+    close(cb->epfd);
+    close(cb->fd);
     free(cb);
 
     return STCP_SUCCESS;
 }
-/*
- * Return a port number based on the uid of the caller.  This will
- * with reasonably high probability return a port number different from
- * that chosen for other uses on the undergraduate Linux systems.
- *
- * This port is used if ports are not specified on the command line.
- */
-int getDefaultPort() {
-    uid_t uid = getuid();
-    int port = (uid % (32768 - 512) * 2) + 1024;
-    assert(port >= 1024 && port <= 65535 - 1);
-    return port;
-}
-
 /*
  * This application is to invoke the send-side functionality.
  */
@@ -503,20 +1383,49 @@ int main(int argc, char **argv) {
     /* You might want to change the size of this buffer to test how your
      * code deals with different packet sizes.
      */
-    unsigned char buffer[STCP_MSS];
+    unsigned char buffer[STCP_MAX_MTU];
+    int mtu = STCP_ETHERNET_MTU;
     int num_read_bytes;
 
-    logConfig("sender", "failure,success,finish,init,sender,thread,checkpoint,debug");
+    logConfig("sender", "failure,success,finish,init,sender,thread,checkpoint,debug,stats");
     // logConfig("sender", "failure,success,finish,init,sender,thread,checkpoint");
     // logConfig("sender", "failure,success,finish,init,sender,thread");
     // logConfig("sender", "failure,success,finish,init,sender");
     // logConfig("sender", "failure,success,finish,init");
     // logConfig("sender", "failure,success,finish");
     // logConfig("sender", "");
+
+    /*
+     * STCP_TRACE names a file to trace packets to in binary instead (see
+     * tracedump), and STCP_PCAP one to capture them to for Wireshark
+     */
+    if (getenv("STCP_TRACE") && traceStart(getenv("STCP_TRACE")) < 0) exit(1);
+    if (getenv("STCP_PCAP") && captureStart(getenv("STCP_PCAP")) < 0) exit(1);
+    /*
+     * -m offers a larger (or smaller) MTU than the Ethernet default, -c
+     * picks the congestion control algorithm, -p paces at a fixed rate
+     * in bytes per second (0 follows cwnd, -1 disables pacing), and -r
+     * hands the file over in stcp_send() calls of that many bytes, as a
+     * record-oriented application would
+     */
+    int opt;
+    char *congestion = NULL;
+    long pacing = STCP_PACING_AUTO;
+    int record = 0;
+    while ((opt = getopt(argc, argv, "m:c:p:r:")) != -1) {
+        if (opt == 'm') mtu = atoi(optarg);
+        else if (opt == 'c') congestion = optarg;
+        else if (opt == 'p') pacing = atol(optarg);
+        else if (opt == 'r') record = max(1, min(STCP_MAX_MTU, atoi(optarg)));
+        else argc = 0;
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
     /* Verify that the arguments are right */
-    if (argc > 5 || argc == 1) {
-        fprintf(stderr, "usage: sender DestinationIPAddress/Name receiveDataOnPort sendDataToPort filename\n");
-        fprintf(stderr, "or   : sender filename\n");
+    if (argc > 5 || argc <= 1) {
+        fprintf(stderr, "usage: sender [-m mtu] [-c newreno|cubic] [-p rate] [-r bytes] DestinationIPAddress/Name receiveDataOnPort sendDataToPort filename\n");
+        fprintf(stderr, "or   : sender [-m mtu] [-c newreno|cubic] [-p rate] [-r bytes] filename\n");
         exit(1);
     }
     if (argc == 2) {
@@ -541,60 +1450,66 @@ int main(int argc, char **argv) {
      * Open connection to destination.  If stcp_open succeeds the
      * control block should be correctly initialized.
      */
-    cb = stcp_open(destinationHost, sendersPort, receiversPort);
+    cb = stcp_open_mtu(destinationHost, sendersPort, receiversPort, mtu);
     if (cb == NULL) {
         /* YOUR CODE HERE */
         logPerror("Failed to open connection");
         exit(1);
     }
+    if (congestion != NULL && stcp_set_congestion(cb, congestion) == STCP_ERROR) {
+        fprintf(stderr, "Unknown congestion control algorithm %s\n", congestion);
+        exit(1);
+    }
+    stcp_set_pacing(cb, pacing);
 
-    pthread_mutex_t file_mutex;
-    pthread_mutex_t logic_mutex;
-    pthread_mutex_init(&file_mutex, NULL);
-    pthread_mutex_init(&logic_mutex, NULL);
-    cb->fileLock = &file_mutex;
-    cb->logicLock = &logic_mutex;
+    /*
+     * STCP_STATS names a file (or "unix:" and a datagram socket) to
+     * export the connection's stats to as JSON, every STCP_STATS_INTERVAL ms
+     */
+    if (getenv("STCP_STATS")) {
+        int interval = getenv("STCP_STATS_INTERVAL") ? atoi(getenv("STCP_STATS_INTERVAL")) : 0;
+        if (stcp_export_stats(cb, getenv("STCP_STATS"), interval) == STCP_ERROR) exit(1);
+    }
 
-    /* Start to send data in file via STCP to remote receiver. Chop up
-     * the file into pieces as large as max packet size and transmit
-     * those pieces.
+    /* Start to send data in file via STCP to remote receiver. The file
+     * is mapped and handed over in whole segments of up to
+     * STCP_SEND_BUFFER bytes at a time, so its contents are never copied
+     * and only the last segment is short. A file that cannot be mapped, or that
+     * -r asks to be sent in records, is chopped up into pieces as large
+     * as max packet size (or the record) with read() instead.
      */
     struct stat st;
-
-    fstat(file, &st);
-    const unsigned int numPackets = ceil(st.st_size / STCP_MSS) + 1;
-
-    logLog("debug", "number of total packets: %d", numPackets);
-
-    pthread_t threads[numPackets];
-    cb->threads = threads;
-
-    while (1) {
-        num_read_bytes = read(file, buffer, sizeof(buffer));
-
-        /* Break when EOF is reached */
-        if (num_read_bytes <= 0)
-            break;
-
-        if (stcp_send(cb, buffer, num_read_bytes) == STCP_ERROR) {
-            /* YOUR CODE HERE */
-            logPerror("!!!!!!!!!!!!!!!!!!!!! Failed to send data");
-        }
+    unsigned char *map = MAP_FAILED;
+    if (record == 0 && fstat(file, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
     }
 
-    cb->state = STCP_SENDER_CLOSING;
-
-    for (int i = 0; i < numPackets; i++) {
-        int result = pthread_join(threads[i], NULL);
-        if (result != 0) {
-            logLog("failure", "Failed to join thread with error code %d", result);
-            exit(1);
-        } else {
-          logLog("success", "Thread %d has finished", i);
+    if (map != MAP_FAILED) {
+        int piece = STCP_SEND_BUFFER / cb->mss * cb->mss;
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        for (off_t off = 0; off < st.st_size; off += piece) {
+            int len = st.st_size - off < piece ? st.st_size - off : piece;
+            if (stcp_send_mapped(cb, map + off, len) == STCP_ERROR) {
+                logPerror("Failed to send data");
+                exit(1);
+            }
+        }
+    } else {
+        while (1) {
+            num_read_bytes = read(file, buffer, record > 0 ? record : cb->mss);
+
+            /* Break when EOF is reached */
+            if (num_read_bytes <= 0)
+                break;
+
+            if (stcp_send(cb, buffer, num_read_bytes) == STCP_ERROR) {
+                /* YOUR CODE HERE */
+                logPerror("Failed to send data");
+                exit(1);
+            }
         }
     }
-
-    logLog("success", "!! All threads have finished !!");
+    close(file);
 
     /* Close the connection to remote receiver */
     if (stcp_close(cb) == STCP_ERROR) {
@@ -602,6 +1517,7 @@ int main(int argc, char **argv) {
         logPerror("Failed to close connection");
         exit(1);
     }
+    if (map != MAP_FAILED) munmap(map, st.st_size);
 
     return 0;
 }
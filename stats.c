@@ -0,0 +1,166 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "log.h"
+#include "stats.h"
+
+/*
+ * Copy every field of from with an atomic load. All of them are
+ * uint64_t, so the struct is walked as an array of them.
+ */
+void statsSnapshot(stcp_stats *to, stcp_stats *from) {
+    uint64_t *src = (uint64_t *) from;
+    uint64_t *dst = (uint64_t *) to;
+
+    for (size_t i = 0; i < sizeof(stcp_stats) / sizeof(uint64_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Write stats into buf as one line of JSON, newline included.
+ * Returns the length of the line, or -1 if it does not fit.
+ */
+int statsJson(const stcp_stats *s, char *buf, int size) {
+    int n = snprintf(buf, size,
+                     "{\"timeMs\":%llu,\"elapsedMs\":%llu,\"goodput\":%llu,"
+                     "\"segmentsSent\":%llu,\"bytesSent\":%llu,\"retransmits\":%llu,"
+                     "\"fastRetransmits\":%llu,\"timeouts\":%llu,\"acksReceived\":%llu,"
+                     "\"dupAcks\":%llu,\"badChecksums\":%llu,\"bytesAcked\":%llu,"
+                     "\"cwnd\":%llu,\"ssthresh\":%llu,\"window\":%llu,\"inFlight\":%llu,"
+                     "\"queued\":%llu,\"srtt\":%llu,\"rto\":%llu}\n",
+                     (unsigned long long) s->timeMs, (unsigned long long) s->elapsedMs,
+                     (unsigned long long) s->goodput, (unsigned long long) s->segmentsSent,
+                     (unsigned long long) s->bytesSent, (unsigned long long) s->retransmits,
+                     (unsigned long long) s->fastRetransmits, (unsigned long long) s->timeouts,
+                     (unsigned long long) s->acksReceived, (unsigned long long) s->dupAcks,
+                     (unsigned long long) s->badChecksums, (unsigned long long) s->bytesAcked,
+                     (unsigned long long) s->cwnd, (unsigned long long) s->ssthresh,
+                     (unsigned long long) s->window, (unsigned long long) s->inFlight,
+                     (unsigned long long) s->queued, (unsigned long long) s->srtt,
+                     (unsigned long long) s->rto);
+    return n < size ? n : -1;
+}
+
+/*
+ * Take a sample and hand it over: as a datagram to the socket, which is
+ * dropped if nobody is listening, or by replacing the file through a
+ * rename(), so a reader never sees half of it.
+ */
+static void emit(statsExporter *e) {
+    stcp_stats stats;
+    char line[STATS_JSON_MAX];
+    char tmp[strlen(e->path) + 5];
+
+    e->sample(e->arg, &stats);
+    int len = statsJson(&stats, line, sizeof(line));
+    if (len < 0) return;
+
+    if (e->fd >= 0) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, e->path, sizeof(addr.sun_path) - 1);
+        sendto(e->fd, line, len, 0, (struct sockaddr *) &addr, sizeof(addr));
+        return;
+    }
+
+    sprintf(tmp, "%s.tmp", e->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+    int written = write(fd, line, len);
+    close(fd);
+    if (written == len) rename(tmp, e->path);
+    else unlink(tmp);
+}
+
+static void *exportMain(void *arg) {
+    statsExporter *e = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&e->lock);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    while (!e->stopping) {
+        deadline.tv_sec += e->intervalMs / 1000;
+        deadline.tv_nsec += (e->intervalMs % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!e->stopping && pthread_cond_timedwait(&e->wake, &e->lock, &deadline) == 0) {
+        }
+        if (e->stopping) break;
+
+        pthread_mutex_unlock(&e->lock);
+        emit(e);
+        pthread_mutex_lock(&e->lock);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+static void exporterFree(statsExporter *e) {
+    if (e->fd >= 0) close(e->fd);
+    free(e->path);
+    free(e);
+}
+
+/*
+ * Export a sample every intervalMs to target: a file name, or
+ * STATS_UNIX_PREFIX and the path of a Unix domain datagram socket.
+ * sample(arg, stats) is called on the exporter's own thread.
+ * Returns the exporter, or NULL if it could not be started.
+ */
+statsExporter *statsExportStart(const char *target, int intervalMs, statsSampler sample, void *arg) {
+    statsExporter *e = calloc(1, sizeof(statsExporter));
+    pthread_condattr_t attr;
+    int unixSocket = strncmp(target, STATS_UNIX_PREFIX, strlen(STATS_UNIX_PREFIX)) == 0;
+
+    if (e == NULL) return NULL;
+    e->sample = sample;
+    e->arg = arg;
+    e->intervalMs = intervalMs > 0 ? intervalMs : STATS_INTERVAL;
+    e->path = strdup(unixSocket ? target + strlen(STATS_UNIX_PREFIX) : target);
+    e->fd = unixSocket ? socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0) : -1;
+    if (e->path == NULL || (unixSocket && e->fd < 0)) {
+        logPerror((char *) target);
+        exporterFree(e);
+        return NULL;
+    }
+
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&e->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&e->thread, NULL, exportMain, e) != 0) {
+        logLog("failure", "Cannot start the stats exporter");
+        pthread_cond_destroy(&e->wake);
+        pthread_mutex_destroy(&e->lock);
+        exporterFree(e);
+        return NULL;
+    }
+    return e;
+}
+
+/*
+ * Stop the exporter, export a last sample from the calling thread, and
+ * free it.
+ */
+void statsExportStop(statsExporter *e) {
+    if (e == NULL) return;
+
+    pthread_mutex_lock(&e->lock);
+    e->stopping = 1;
+    pthread_cond_signal(&e->wake);
+    pthread_mutex_unlock(&e->lock);
+    pthread_join(e->thread, NULL);
+
+    emit(e);
+    pthread_cond_destroy(&e->wake);
+    pthread_mutex_destroy(&e->lock);
+    exporterFree(e);
+}
@@ -0,0 +1,69 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Counters a connection keeps about itself, for stcp_get_stats() and for
+ * export as JSON while it runs. Only the connection's own thread writes
+ * them, so statsAdd() is an atomic load and store rather than a locked
+ * read-modify-write; statsSnapshot() may run on any thread and sees
+ * every field whole, if not all from the same instant.
+ */
+
+#define STATS_INTERVAL 1000             /* default ms between exports */
+#define STATS_JSON_MAX 1024             /* longest line statsJson() writes */
+#define STATS_UNIX_PREFIX "unix:"       /* export target naming a datagram socket */
+
+typedef struct {
+    /* filled in by the snapshot */
+    uint64_t timeMs;                    /* wall clock ms since the epoch */
+    uint64_t elapsedMs;                 /* since the connection was established */
+    uint64_t goodput;                   /* bytes acked per second over elapsedMs */
+
+    /* counters */
+    uint64_t segmentsSent;              /* retransmissions included */
+    uint64_t bytesSent;                 /* payload bytes, retransmissions included */
+    uint64_t retransmits;
+    uint64_t fastRetransmits;
+    uint64_t timeouts;
+    uint64_t acksReceived;
+    uint64_t dupAcks;
+    uint64_t badChecksums;
+    uint64_t bytesAcked;
+
+    /* current values */
+    uint64_t cwnd;
+    uint64_t ssthresh;
+    uint64_t window;                    /* the receiver's, already scaled */
+    uint64_t inFlight;
+    uint64_t queued;                    /* bytes not transmitted yet */
+    uint64_t srtt;                      /* us */
+    uint64_t rto;                       /* ms */
+} stcp_stats;
+
+#define statsAdd(field, n) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define statsSet(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+/* Fills in a fresh snapshot of arg's stats */
+typedef void (*statsSampler)(void *arg, stcp_stats *stats);
+
+typedef struct {
+    statsSampler sample;
+    void *arg;
+    char *path;                         /* file, or socket after STATS_UNIX_PREFIX */
+    int fd;                             /* datagram socket, or -1 to write the file */
+    int intervalMs;
+    int stopping;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} statsExporter;
+
+extern void statsSnapshot(stcp_stats *to, stcp_stats *from);
+extern int statsJson(const stcp_stats *stats, char *buf, int size);
+extern statsExporter *statsExportStart(const char *target, int intervalMs, statsSampler sample, void *arg);
+extern void statsExportStop(statsExporter *e);
+
+#endif
@@ -5,6 +5,7 @@
  * Version 1.0
  */
 
+#include <assert.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,7 +17,11 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "stcp.h"
 
@@ -41,63 +46,219 @@ unsigned int hostname_to_ipaddr(const char *s) {
 
 /*
  * Print an STCP packet to standard output. dir is either 's'ent or
- * 'r'eceived packet
+ * 'r'eceived packet, and pkt its header in host byte order followed by
+ * any options. While capturing or tracing it goes to the pcap file or
+ * becomes a binary trace record instead. Nothing is formatted unless
+ * the packet channel is on; callers that must convert the header first
+ * check dumpOn().
  */
 void dump(char dir, void *pkt, int len) {
     tcpheader *stcpHeader = (tcpheader *) pkt;
-    logLog("sender", "%c %s payload %d bytes", dir, tcpHdrToString(stcpHeader), len - sizeof(tcpheader));
+    if (captureActive) capturePacket(dir, stcpHeader, len);
+    if (__atomic_load_n(&traceActive, __ATOMIC_RELAXED)) {
+        traceLog("packet", dir == 's' ? TRACE_SENT : TRACE_RECEIVED, stcpHeader->flags,
+                 stcpHeader->seqNo, stcpHeader->ackNo, len - (int) sizeof(tcpheader), stcpHeader->windowSize);
+        return;
+    }
+    if (captureActive || !logOn("packet")) return;
+    logWrite("packet", "%c %s payload %d bytes", dir, tcpHdrToString(stcpHeader), len - (int) sizeof(tcpheader));
     fflush(stdout);
 }
 
-// Compute Internet Checksum for "len" bytes beginning at location "data".
-unsigned short ipchecksum(void *data, int len) {
-    register int sum = 0;
-
-    while (len > 1)  {
-        sum += * (unsigned short *) data;
+/*
+ * Add "len" bytes beginning at location "data" to a running Internet
+ * checksum accumulator. Words are summed eight bytes at a time into 64
+ * bits and folded once at the end; the carries out of each 16-bit lane
+ * end up in the upper half and come back in by end-around carry, so the
+ * result is the same as a 16-bit ones' complement sum. Every chunk but
+ * the last must have an even length.
+ */
+static unsigned long long checksumAddScalar(unsigned long long sum, const unsigned char *data, int len) {
+    while (len >= 8) {
+        unsigned long long w;
+        memcpy(&w, data, 8);
+        sum += (w & 0xffffffff) + (w >> 32);
+        data += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        unsigned int w;
+        memcpy(&w, data, 4);
+        sum += w;
+        data += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        unsigned short w;
+        memcpy(&w, data, 2);
+        sum += w;
         data += 2;
         len -= 2;
     }
 
     /*  Add left-over byte, if any */
     if (len > 0) {
-        sum += * (unsigned char *) data;
+        sum += *data;
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * SIMD versions of checksumAddScalar(). Each 32-bit word is widened into
+ * a 64-bit lane so the lanes cannot overflow, and the lanes are added
+ * into the scalar accumulator at the end. The tail goes through the
+ * scalar loop.
+ */
+__attribute__((target("sse2")))
+static unsigned long long checksumAddSse2(unsigned long long sum, const unsigned char *data, int len) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+
+    while (len >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) data);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+        data += 16;
+        len -= 16;
+    }
+
+    unsigned long long lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    sum += (lanes[0] & 0xffffffff) + (lanes[0] >> 32);
+    sum += (lanes[1] & 0xffffffff) + (lanes[1] >> 32);
+    return checksumAddScalar(sum, data, len);
+}
+
+__attribute__((target("avx2")))
+static unsigned long long checksumAddAvx2(unsigned long long sum, const unsigned char *data, int len) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+
+    while (len >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) data);
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+        data += 32;
+        len -= 32;
+    }
+
+    unsigned long long lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    for (int i = 0; i < 4; i++) {
+        sum += (lanes[i] & 0xffffffff) + (lanes[i] >> 32);
     }
-    /*  Fold 32-bit sum to 16 bits */
+    return checksumAddScalar(sum, data, len);
+}
+#endif
+
+typedef unsigned long long (*checksumAddFn)(unsigned long long, const unsigned char *, int);
+
+/* Pick the widest implementation the CPU supports, once */
+static checksumAddFn checksumImpl(void) {
+    static checksumAddFn impl;
+
+    if (impl == NULL) {
+        impl = checksumAddScalar;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            impl = checksumAddAvx2;
+        } else if (__builtin_cpu_supports("sse2")) {
+            impl = checksumAddSse2;
+        }
+#endif
+    }
+    return impl;
+}
+
+static unsigned long long checksumAdd(unsigned long long sum, void *data, int len) {
+    /* Short runs (a bare header) are not worth the vector setup */
+    if (len < 64) return checksumAddScalar(sum, data, len);
+    return checksumImpl()(sum, data, len);
+}
+
+static unsigned short checksumFold(unsigned long long sum) {
+    /*  Fold 64-bit sum to 16 bits */
     while (sum >> 16) {
         sum = (sum & 0xffff) + (sum >> 16);
     }
     return ~sum;
 }
 
+// Compute Internet Checksum for "len" bytes beginning at location "data".
+unsigned short ipchecksum(void *data, int len) {
+    return checksumFold(checksumAdd(0, data, len));
+}
+
+/*
+ * Compute the Internet Checksum of a packet whose header and payload are
+ * stored apart, without copying them together. hdrLen must be even.
+ */
+unsigned short ipchecksumSplit(void *hdr, int hdrLen, void *data, int len) {
+    return checksumFold(checksumAdd(checksumAdd(0, hdr, hdrLen), data, len));
+}
+
+/*
+ * Update a checksum for one 16-bit word of the packet changing from
+ * oldWord to newWord, without summing the rest of the packet again
+ * (RFC 1624, eqn. 3). The words are given as they are stored in the
+ * packet, i.e. in network byte order.
+ */
+unsigned short ipchecksumUpdate(unsigned short check, unsigned short oldWord, unsigned short newWord) {
+    unsigned long long sum = (unsigned short) ~check;
+    sum += (unsigned short) ~oldWord;
+    sum += newWord;
+    return checksumFold(sum);
+}
+
+/* As ipchecksumUpdate(), for a 32-bit field such as seqNo or ackNo */
+unsigned short ipchecksumUpdate32(unsigned short check, unsigned int oldValue, unsigned int newValue) {
+    check = ipchecksumUpdate(check, oldValue & 0xffff, newValue & 0xffff);
+    return ipchecksumUpdate(check, oldValue >> 16, newValue >> 16);
+}
+
 /*
  * Helper function to prepare an STCP segment for sending.  Initializes all
  * the fields of the header except the checksum.
  */
 void createSegment(packet *pkt, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, unsigned char *data, int len) {
-    initPacket(pkt, data, len + sizeof(tcpheader));
-    tcpheader *hdr = pkt->hdr;
+    initPacket(pkt, NULL, len + sizeof(tcpheader));
+    if (data != NULL) memcpy(pkt->data + sizeof(tcpheader), data, len);
+    createHeader(pkt->hdr, flags, rwnd, seq, ack);
+}
+
+/*
+ * Initialize all the fields of an STCP header, in host byte order,
+ * except the checksum.
+ */
+void createHeader(tcpheader *hdr, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack) {
     hdr->srcPort = 0;
     hdr->dstPort = 0;
     hdr->seqNo = seq;
     hdr->ackNo = ack;
     hdr->windowSize = rwnd;
-    hdr->flags = (5 << 12) | flags;
+    hdr->dataOffset = sizeof(tcpheader) / 4;
+    hdr->flags = flags;
     hdr->checksum = 0;
+    hdr->urgentPointer = 0;
 }
 
 /*
  * Helper function to read a STCP packet from the network.
  * As a side effect print the packet header to standard output.
  */
-static int readpkt(int fd, void *pkt, int len) {
-    int cc = recv(fd, pkt, len, 0);
+static int readpkt(int fd, void *pkt, int len, int flags) {
+    int cc = recv(fd, pkt, len, flags);
     if (cc > 0) {
-        tcpheader *hdr = (tcpheader *)pkt;
-        ntohHdr(hdr);
-        dump('r', pkt, cc);
-        htonHdr(hdr);
+        if (dumpOn()) {
+            tcpheader *hdr = (tcpheader *)pkt;
+            ntohHdr(hdr);
+            dump('r', pkt, cc);
+            htonHdr(hdr);
+        }
     } else {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return STCP_READ_TIMED_OUT;
         logPerror("readpkt");
         if (errno == ECONNREFUSED) return STCP_READ_PERMANENT_FAILURE;
     }
@@ -123,7 +284,7 @@ int readWithTimeout(int fd, unsigned char *pkt, int ms) {
     FD_SET(fd, &fds);
     s = select(fd + 1, &fds, 0, 0, &tv);
     if (s > 0 && FD_ISSET(fd, &fds)) {
-        int res = readpkt(fd, pkt, STCP_MTU);
+        int res = readpkt(fd, pkt, STCP_MTU, 0);
         if (res < 0) {
             logPerror("readWithTimeout");
             return errno == ECONNREFUSED ? STCP_READ_PERMANENT_FAILURE :  STCP_READ_TIMED_OUT;
@@ -134,6 +295,196 @@ int readWithTimeout(int fd, unsigned char *pkt, int ms) {
     }
 }
 
+/*
+ * Read every datagram already queued on the socket, up to count, with a
+ * single recvmmsg() call. Buffer i starts at bufs + i * bufLen and
+ * lens[i] receives the number of bytes read into it. If fd has UDP GRO
+ * enabled, a buffer may hold a run of datagrams the kernel coalesced,
+ * packed back to back and each segSizes[i] bytes long except perhaps the
+ * last; segSizes[i] is lens[i] if nothing was coalesced. segSizes may be
+ * NULL when GRO is off.
+ * Returns:
+ *   The number of buffers filled, or
+ *   STCP_READ_TIMED_OUT if no packet is waiting
+ *   STCP_READ_PERMANENT_FAILURE if reads will never work again (socket closed)
+ */
+int readBatch(int fd, unsigned char *bufs, int bufLen, int *lens, int *segSizes, int count) {
+    struct mmsghdr msgs[STCP_IO_BATCH];
+    struct iovec iov[STCP_IO_BATCH];
+    char control[STCP_IO_BATCH][CMSG_SPACE(sizeof(int))];
+
+    count = min(count, STCP_IO_BATCH);
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = bufs + (size_t) i * bufLen;
+        iov[i].iov_len = bufLen;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (segSizes != NULL) {
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+    }
+
+    int n = recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL);
+    if (n <= 0) {
+        if (n == 0 || errno == EAGAIN || errno == EWOULDBLOCK) return STCP_READ_TIMED_OUT;
+        logPerror("readBatch");
+        return errno == ECONNREFUSED ? STCP_READ_PERMANENT_FAILURE : STCP_READ_TIMED_OUT;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct msghdr *msg = &msgs[i].msg_hdr;
+        int segSize = lens[i] = msgs[i].msg_len;
+
+        if (segSizes != NULL) {
+            for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                    segSize = *(int *) CMSG_DATA(cm);
+                }
+            }
+            segSizes[i] = segSize;
+        }
+        if (!dumpOn()) continue;
+        for (int off = 0; off + (int) sizeof(tcpheader) <= lens[i]; off += segSize) {
+            int segLen = min(segSize, lens[i] - off);
+            unsigned char hdr[sizeof(tcpheader) + TCP_MAX_OPTIONS];
+            memcpy(hdr, bufs + (size_t) i * bufLen + off, min(segLen, (int) sizeof(hdr)));
+            ntohHdr((tcpheader *) hdr);
+            dump('r', hdr, segLen);
+        }
+    }
+    return n;
+}
+
+/*
+ * Queue one datagram, gathered from hdr and payload, on a batch. The
+ * caller must flush the batch with writeBatch() before it is full.
+ */
+void batchAdd(packetBatch *batch, void *hdr, int hdrLen, void *payload, int payloadLen) {
+    int i = batch->count++;
+
+    batch->iov[i][0].iov_base = hdr;
+    batch->iov[i][0].iov_len = hdrLen;
+    batch->iov[i][1].iov_base = payload;
+    batch->iov[i][1].iov_len = payloadLen;
+    batch->lens[i] = hdrLen + payloadLen;
+}
+
+/*
+ * Build the messages for the datagrams of a batch from index from on.
+ * Without GSO every datagram is a message of its own. With it, a run of
+ * datagrams of the same size, optionally ending in a shorter one, shares
+ * one message whose UDP_SEGMENT tells the kernel where to cut. first[m]
+ * is set to the index of message m's first datagram, and first[] ends
+ * with batch->count.
+ *
+ * Returns the number of messages.
+ */
+static int batchMessages(packetBatch *batch, int from, int *first) {
+    int m = 0;
+
+    for (int i = from; i < batch->count; m++) {
+        int size = batch->lens[i];
+        int n = 1;
+        int bytes = size;
+
+        while (batch->gso && i + n < batch->count && batch->lens[i + n] <= size &&
+               bytes + batch->lens[i + n] <= STCP_GSO_MAX_BYTES) {
+            bytes += batch->lens[i + n++];
+            if (batch->lens[i + n - 1] < size) break;
+        }
+
+        struct msghdr *msg = &batch->msgs[m].msg_hdr;
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_iov = batch->iov[i];
+        msg->msg_iovlen = 2 * n;
+        if (n > 1) {
+            msg->msg_control = batch->control[m];
+            msg->msg_controllen = sizeof(batch->control[m]);
+            struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+            *(unsigned short *) CMSG_DATA(cm) = size;
+        }
+        first[m] = i;
+        i += n;
+    }
+    first[m] = batch->count;
+    return m;
+}
+
+/*
+ * Send every datagram queued on the batch, using as few sendmmsg() calls
+ * as the kernel allows, and empty it. If the kernel or the device turns
+ * GSO down, the batch stops using it and sends datagram by datagram.
+ * Returns the number of datagrams sent, or STCP_READ_PERMANENT_FAILURE if
+ * the socket will never work again.
+ */
+int writeBatch(int fd, packetBatch *batch) {
+    int first[STCP_IO_BATCH + 1];
+    int sent = 0;
+
+    while (sent < batch->count) {
+        int count = batchMessages(batch, sent, first);
+        int n = sendmmsg(fd, batch->msgs, count, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (batch->gso && (errno == EIO || errno == EINVAL)) {
+                logLog("init", "UDP GSO refused, sending datagrams one at a time");
+                batch->gso = 0;
+                continue;
+            }
+            logPerror("writeBatch");
+            if (errno == ECONNREFUSED) {
+                batch->count = 0;
+                return STCP_READ_PERMANENT_FAILURE;
+            }
+            /* Drop the datagrams the kernel refused, retransmission recovers them */
+            n = 1;
+        }
+        sent = first[n];
+    }
+    batch->count = 0;
+    return sent;
+}
+
+/*
+ * Return 1 if the kernel can segment UDP sends on fd (UDP_SEGMENT).
+ */
+int udpGsoSupported(int fd) {
+    int size;
+    socklen_t len = sizeof(size);
+    return getsockopt(fd, SOL_UDP, UDP_SEGMENT, &size, &len) == 0;
+}
+
+/*
+ * Let the kernel hand runs of datagrams from the same flow to fd as one
+ * coalesced buffer (UDP_GRO); read them with readCoalesced().
+ * Returns 0, or -1 if the kernel does not support it.
+ */
+int udpEnableGro(int fd) {
+    int on = 1;
+    return setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on));
+}
+
+/*
+ * Read one datagram, or one run of datagrams the kernel coalesced, that
+ * is already queued on the socket. buf should hold STCP_GRO_BUFFER
+ * bytes. The datagrams are packed back to back, each *segSize bytes long
+ * except perhaps the last; *segSize is the whole length if nothing was
+ * coalesced.
+ * Returns:
+ *   The number of bytes read, or
+ *   STCP_READ_TIMED_OUT if no packet is waiting
+ *   STCP_READ_PERMANENT_FAILURE if reads will never work again (socket closed)
+ */
+int readCoalesced(int fd, unsigned char *buf, int len, int *segSize) {
+    int n = readBatch(fd, buf, len, &len, segSize, 1);
+    return n < 0 ? n : len;
+}
+
 /*
  * Set an I/O channel (file descriptor) to non-blocking mode.
  */
@@ -195,9 +546,24 @@ int udp_open(char *remote_IP_str, int remote_port, int local_port) {
         logPerror("connect");
         return -1;
     }
+    if (captureActive) captureEndpoints(fd);
     logLog("init", "UDP \"connection\" to <%u.%u.%u.%u, port %d> configured",
 	   (ntohl(dst)>>24) & 0xFF, (ntohl(dst)>>16) & 0xFF,
 	   (ntohl(dst)>>8) & 0XFF, ntohl(dst) & 0XFF , remote_port);
 
     return (fd);
 }
+
+/*
+ * Return a port number based on the uid of the caller.  This will
+ * with reasonably high probability return a port number different from
+ * that chosen for other uses on the undergraduate Linux systems.
+ *
+ * This port is used if ports are not specified on the command line.
+ */
+int getDefaultPort() {
+    uid_t uid = getuid();
+    int port = (uid % (32768 - 512) * 2) + 1024;
+    assert(port >= 1024 && port <= 65535 - 1);
+    return port;
+}
@@ -9,20 +9,33 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include "tcp.h"
 #include "log.h"
+#include "trace.h"
+#include "capture.h"
 
 #define STCP_MAXWIN    65535 
-#define STCP_MTU       300     /* MTU size */
+#define STCP_MTU       300     /* MTU size, unless the SYN exchange agrees on another */
 #define STCP_MSS       (STCP_MTU - sizeof(tcpheader)) /* MSS Size */
+#define STCP_ETHERNET_MTU 1472 /* UDP payload of a 1500-byte Ethernet frame */
+#define STCP_JUMBO_MTU 8972    /* UDP payload of a 9000-byte jumbo frame */
+#define STCP_MIN_MTU   64
+#define STCP_MAX_MTU   STCP_JUMBO_MTU
 #define STCP_READ_TIMED_OUT (-3)
 #define STCP_READ_PERMANENT_FAILURE (-4)
 #define STCP_INITIAL_TIMEOUT 1000
 #define STCP_MIN_TIMEOUT 1000
 #define STCP_MAX_TIMEOUT 4000
+#define STCP_RTO_FLOOR 10        /* default lower bound of the adaptive RTO (ms) */
+#define STCP_RTO_CEILING STCP_MAX_TIMEOUT
+#define STCP_CLOCK_GRANULARITY 1000 /* resolution of the retransmission timers in microseconds */
 #define STCP_INFINITE_TIMEOUT 10000
 #define STCP_TIME_WAIT_DURATION 2000
 #define EXCESS_FIN_THRESHOLD 3
+#define STCP_IO_BATCH  32      /* datagrams per sendmmsg()/recvmmsg() call */
+#define STCP_GSO_MAX_BYTES 65507 /* largest UDP payload, and so largest GSO send */
+#define STCP_GRO_BUFFER 65536  /* receive buffer that holds any coalesced read */
 
 static inline int min(int a, int b) { return a < b ? a : b; }
 static inline int max(int a, int b) { return a > b ? a : b; }
@@ -38,10 +51,20 @@ static inline int stcpNextTimeout(int timeout) { return min(STCP_MAX_TIMEOUT, ti
 #define STCP_SENDER_CLOSING 3
 #define STCP_SENDER_FIN_WAIT 4
 
+/* The receiver can be in four: CLOSED, LISTEN, ESTABLISHED and TIME_WAIT */
+#define STCP_RECEIVER_CLOSED 0
+#define STCP_RECEIVER_LISTEN 1
+#define STCP_RECEIVER_ESTABLISHED 2
+#define STCP_RECEIVER_TIME_WAIT 3
+
+/*
+ * A datagram and its length. The packet is allocated together with room
+ * for the connection's MTU, so data is sized at run time.
+ */
 typedef struct packet {
-    unsigned char data[STCP_MTU];
     tcpheader *hdr;
     int len;
+    unsigned char data[];
 } packet;
 
 static inline int payloadSize(packet *pkt) {
@@ -54,14 +77,48 @@ static inline void initPacket(packet *pkt, unsigned char *data, int len) {
     if (data != NULL) memcpy(pkt->data, data, len);
 }
 
+/*
+ * Datagrams queued for a single sendmmsg(). Each one is gathered from a
+ * header and an optional payload, so neither has to be copied next to
+ * the other. With gso set, runs of datagrams of the same size go to the
+ * kernel as one message that it cuts up again (UDP_SEGMENT), so each
+ * still carries its own header and checksum on the wire.
+ */
+typedef struct packetBatch {
+    struct mmsghdr msgs[STCP_IO_BATCH];
+    struct iovec iov[STCP_IO_BATCH][2];
+    int lens[STCP_IO_BATCH];
+    char control[STCP_IO_BATCH][CMSG_SPACE(sizeof(unsigned short))];
+    int count;
+    int gso;
+} packetBatch;
+
+static inline int batchFull(packetBatch *batch) {
+    return batch->count == STCP_IO_BATCH;
+}
+
 /* Declarations for STCP.C */
 
 extern void createSegment(packet *pkt, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, unsigned char *data, int len);
+extern void createHeader(tcpheader *hdr, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack);
 extern void dump(char dir, void* pkt, int len);
+
+/* Whether dump() has anything to do, for callers that must prepare a header first */
+#define dumpOn() (captureActive || traceActive || logOn("packet"))
 extern unsigned int hostname_to_ipaddr(const char *s);
 extern int readWithTimeout(int fd, unsigned char *pkt, int ms);
+extern int readBatch(int fd, unsigned char *bufs, int bufLen, int *lens, int *segSizes, int count);
+extern void batchAdd(packetBatch *batch, void *hdr, int hdrLen, void *payload, int payloadLen);
+extern int writeBatch(int fd, packetBatch *batch);
+extern int udpGsoSupported(int fd);
+extern int udpEnableGro(int fd);
+extern int readCoalesced(int fd, unsigned char *buf, int len, int *segSize);
 extern unsigned short ipchecksum(void *data, int len);
+extern unsigned short ipchecksumSplit(void *hdr, int hdrLen, void *data, int len);
+extern unsigned short ipchecksumUpdate(unsigned short check, unsigned short oldWord, unsigned short newWord);
+extern unsigned short ipchecksumUpdate32(unsigned short check, unsigned int oldValue, unsigned int newValue);
 extern int udp_open(char *remote_IP_str, int remote_port, int local_port);
+extern int getDefaultPort();
 
 #include "wraparound.h"
 
@@ -1,13 +1,18 @@
 #include <arpa/inet.h>
 #include <stdio.h>
+#include <string.h>
 #include "tcp.h"
 
 #define MAXLENGTH 128
 #define NBUFFERS   20
 
+/*
+ * Describe a header in host byte order. The string is good for the next
+ * NBUFFERS - 1 calls from the same thread.
+ */
 char *tcpHdrToString(tcpheader *hdr) {
-    static char buff[NBUFFERS][MAXLENGTH];
-    static int next = 0;
+    static __thread char buff[NBUFFERS][MAXLENGTH];
+    static __thread int next = 0;
     char *buf = &buff[next][0];
     next = (next + 1) % NBUFFERS;
     
@@ -38,4 +43,93 @@ void htonHdr(tcpheader *hdr) {
     hdr->checksum = htons(hdr->checksum);
     hdr->urgentPointer = htons(hdr->urgentPointer);
 }
-    
+
+/*
+ * Encode the options in opts that are set into buf, padded to a whole
+ * number of 32-bit words, in network byte order. buf must hold
+ * TCP_MAX_OPTIONS bytes. Returns the number of bytes written, which is
+ * what dataOffset must account for beyond the header.
+ */
+int tcpWriteOptions(unsigned char *buf, tcpoptions *opts) {
+    int len = 0;
+
+    if (opts->mss > 0) {
+        buf[len++] = TCPOPT_MSS;
+        buf[len++] = TCPOLEN_MSS;
+        buf[len++] = opts->mss >> 8;
+        buf[len++] = opts->mss & 0xff;
+    }
+    if (opts->hasWscale) {
+        buf[len++] = TCPOPT_NOP;
+        buf[len++] = TCPOPT_WSCALE;
+        buf[len++] = TCPOLEN_WSCALE;
+        buf[len++] = opts->wscale;
+    }
+    if (opts->sackPermitted) {
+        buf[len++] = TCPOPT_NOP;
+        buf[len++] = TCPOPT_NOP;
+        buf[len++] = TCPOPT_SACK_PERMITTED;
+        buf[len++] = TCPOLEN_SACK_PERMITTED;
+    }
+    if (opts->sackBlocks > 0) {
+        buf[len++] = TCPOPT_NOP;
+        buf[len++] = TCPOPT_NOP;
+        buf[len++] = TCPOPT_SACK;
+        buf[len++] = 2 + opts->sackBlocks * TCPOLEN_SACK_BLOCK;
+        for (int b = 0; b < opts->sackBlocks; b++) {
+            for (int edge = 0; edge < 2; edge++) {
+                unsigned int seq = opts->sack[b][edge];
+                buf[len++] = seq >> 24;
+                buf[len++] = seq >> 16;
+                buf[len++] = seq >> 8;
+                buf[len++] = seq;
+            }
+        }
+    }
+    while (len % 4) buf[len++] = TCPOPT_EOL;
+    return len;
+}
+
+/*
+ * Decode the options of a received packet of len bytes. Options that are
+ * absent, or that the packet is too short to hold, are left zero in
+ * opts; unknown options are skipped.
+ *
+ * Returns 0, or -1 if the option bytes are malformed.
+ */
+int tcpParseOptions(unsigned char *pkt, int len, tcpoptions *opts) {
+    tcpheader *hdr = (tcpheader *) pkt;
+    int end = hdr->dataOffset * 4;
+    int i = sizeof(tcpheader);
+
+    memset(opts, 0, sizeof(*opts));
+    if (len < (int) sizeof(tcpheader) || end > len) return 0;
+
+    while (i < end) {
+        int kind = pkt[i];
+        if (kind == TCPOPT_EOL) break;
+        if (kind == TCPOPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= end || pkt[i + 1] < 2 || i + pkt[i + 1] > end) return -1;
+        if (kind == TCPOPT_MSS && pkt[i + 1] == TCPOLEN_MSS) {
+            opts->mss = (pkt[i + 2] << 8) | pkt[i + 3];
+        } else if (kind == TCPOPT_WSCALE && pkt[i + 1] == TCPOLEN_WSCALE) {
+            opts->hasWscale = 1;
+            opts->wscale = pkt[i + 2] > TCP_MAX_WSCALE ? TCP_MAX_WSCALE : pkt[i + 2];
+        } else if (kind == TCPOPT_SACK_PERMITTED && pkt[i + 1] == TCPOLEN_SACK_PERMITTED) {
+            opts->sackPermitted = 1;
+        } else if (kind == TCPOPT_SACK && (pkt[i + 1] - 2) % TCPOLEN_SACK_BLOCK == 0) {
+            unsigned char *block = pkt + i + 2;
+            opts->sackBlocks = (pkt[i + 1] - 2) / TCPOLEN_SACK_BLOCK;
+            if (opts->sackBlocks > TCP_MAX_SACK) opts->sackBlocks = TCP_MAX_SACK;
+            for (int b = 0; b < opts->sackBlocks; b++, block += TCPOLEN_SACK_BLOCK) {
+                opts->sack[b][0] = (block[0] << 24) | (block[1] << 16) | (block[2] << 8) | block[3];
+                opts->sack[b][1] = (block[4] << 24) | (block[5] << 16) | (block[6] << 8) | block[7];
+            }
+        }
+        i += pkt[i + 1];
+    }
+    return 0;
+}
@@ -19,6 +19,35 @@ typedef enum tcpflags {
     ACK = 0b000010000
 } tcpflags;
     
+/*
+ * Options follow the header when dataOffset is more than 5. SYN and
+ * SYN-ACK packets use them to agree on per-connection parameters; a peer
+ * that does not know them answers without any. Once both sides permit
+ * SACK, ACKs may carry SACK blocks (RFC 2018) too.
+ */
+#define TCPOPT_EOL      0
+#define TCPOPT_NOP      1
+#define TCPOPT_MSS      2
+#define TCPOLEN_MSS     4
+#define TCPOPT_WSCALE   3
+#define TCPOLEN_WSCALE  3
+#define TCP_MAX_WSCALE  14                      // largest shift RFC 7323 allows
+#define TCPOPT_SACK_PERMITTED  4
+#define TCPOLEN_SACK_PERMITTED 2
+#define TCPOPT_SACK     5
+#define TCPOLEN_SACK_BLOCK 8
+#define TCP_MAX_SACK    4                       // blocks that fit, with the NOPs that align them
+#define TCP_MAX_OPTIONS 40                      // dataOffset is at most 15 words
+
+typedef struct tcpoptions {
+    int mss;                                    // 0 if the option is absent
+    int hasWscale;                              // window scaling offered
+    int wscale;                                 // shift applied to windows we advertise
+    int sackPermitted;                          // SYN only: SACK blocks may follow
+    int sackBlocks;                             // SACK blocks carried, at most TCP_MAX_SACK
+    unsigned int sack[TCP_MAX_SACK][2];         // [start, end) of data received past the ACK
+} tcpoptions;
+
 static inline void setFin(tcpheader *hdr) { hdr->flags |= FIN; }
 static inline void setSyn(tcpheader *hdr) { hdr->flags |= SYN; }
 static inline void setRst(tcpheader *hdr) { hdr->flags |= RST; }
@@ -28,7 +57,19 @@ static inline int getSyn(tcpheader *hdr) { return (hdr->flags & SYN) >> 1; }
 static inline int getRst(tcpheader *hdr) { return (hdr->flags & RST) >> 2; }
 static inline int getAck(tcpheader *hdr) { return (hdr->flags & ACK) >> 4; }
 
+/*
+ * Bytes of header, options included, at the start of a packet of len
+ * bytes. Peers that predate options leave dataOffset 0, so a dataOffset
+ * that does not describe a header inside the packet means a plain one.
+ */
+static inline int tcpHeaderLength(tcpheader *hdr, int len) {
+    int hdrLen = hdr->dataOffset * 4;
+    return hdrLen >= (int) sizeof(tcpheader) && hdrLen <= len ? hdrLen : (int) sizeof(tcpheader);
+}
+
 extern char *tcpHdrToString(tcpheader *hdr);
 extern void ntohHdr(tcpheader *hdr);
 extern void htonHdr(tcpheader *hdr);
+extern int tcpWriteOptions(unsigned char *buf, tcpoptions *opts);
+extern int tcpParseOptions(unsigned char *pkt, int len, tcpoptions *opts);
 #endif
@@ -0,0 +1,90 @@
+#include "stcp.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define CAPTURE_FILE "testcapture.pcap"
+
+int main(int argc, char **argv) {
+    unsigned char syn[sizeof(tcpheader) + TCP_MAX_OPTIONS];
+    tcpheader data;
+    tcpoptions offer = { .mss = 1452, .hasWscale = 1, .wscale = 3, .sackPermitted = 1 };
+
+    logConfig("testcapture", "");
+    assert(captureStart(CAPTURE_FILE) == 0);
+    assert(captureStart(CAPTURE_FILE) == -1);
+
+    /* A UDP socket connected to itself supplies both endpoints */
+    struct sockaddr_in sin;
+    socklen_t sinLen = sizeof(sin);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(bind(fd, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+    assert(getsockname(fd, (struct sockaddr *) &sin, &sinLen) == 0);
+    assert(connect(fd, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+    captureEndpoints(fd);
+    close(fd);
+
+    /* A SYN with options, then a data segment captured without its payload */
+    int optLen = tcpWriteOptions(syn + sizeof(tcpheader), &offer);
+    createHeader((tcpheader *) syn, SYN, STCP_MAXWIN, 1000, 0);
+    ((tcpheader *) syn)->dataOffset = (sizeof(tcpheader) + optLen) / 4;
+    dump('s', syn, sizeof(tcpheader) + optLen);
+    createHeader(&data, ACK, 4000, 1001, 77);
+    dump('r', &data, sizeof(tcpheader) + 1452);
+    captureStop();
+
+    FILE *f = fopen(CAPTURE_FILE, "rb");
+    uint32_t fh[6];
+    uint32_t rh[4];
+    unsigned char pkt[128];
+    assert(f != NULL && fread(fh, sizeof(fh), 1, f) == 1);
+    assert(fh[0] == 0xa1b23c4d && fh[5] == CAPTURE_LINKTYPE_RAW);
+
+    /* IPv4 carrying TCP, with dataOffset moved to the top nibble */
+    assert(fread(rh, sizeof(rh), 1, f) == 1);
+    assert(rh[2] == 20 + sizeof(tcpheader) + optLen && rh[3] == rh[2]);
+    assert(fread(pkt, rh[2], 1, f) == 1);
+    assert(pkt[0] == 0x45 && pkt[9] == IPPROTO_TCP);
+    assert(ntohs(*(uint16_t *) (pkt + 2)) == rh[3]);
+    assert(ipchecksum(pkt, 20) == 0);
+    assert(ntohs(*(uint16_t *) (pkt + 20)) == ntohs(sin.sin_port));
+    assert(ntohl(*(uint32_t *) (pkt + 24)) == 1000);
+    assert(pkt[32] == ((sizeof(tcpheader) + optLen) / 4) << 4 && pkt[33] == SYN);
+    assert(memcmp(pkt + 40, syn + sizeof(tcpheader), optLen) == 0);
+
+    /* The payload counts in the lengths but is not captured */
+    assert(fread(rh, sizeof(rh), 1, f) == 1);
+    assert(rh[2] == 40 && rh[3] == 40 + 1452);
+    assert(fread(pkt, rh[2], 1, f) == 1);
+    assert(ntohs(*(uint16_t *) (pkt + 2)) == 40 + 1452);
+    assert(ntohl(*(uint32_t *) (pkt + 28)) == 77 && pkt[33] == ACK);
+    assert(ntohs(*(uint16_t *) (pkt + 34)) == 4000);
+    assert(fread(rh, 1, 1, f) == 0);
+    fclose(f);
+
+    /* Enough segments to fill several buffers all reach the file, in order */
+    int many = 3 * CAPTURE_BUFFER / (16 + 40) + 1;
+    assert(captureStart(CAPTURE_FILE) == 0);
+    for (int i = 0; i < many; i++) {
+        createHeader(&data, ACK, 4000, i, 77);
+        dump('s', &data, sizeof(tcpheader));
+    }
+    captureStop();
+    f = fopen(CAPTURE_FILE, "rb");
+    assert(f != NULL && fread(fh, sizeof(fh), 1, f) == 1);
+    for (int i = 0; i < many; i++) {
+        assert(fread(rh, sizeof(rh), 1, f) == 1 && rh[2] == 40);
+        assert(fread(pkt, rh[2], 1, f) == 1);
+        assert(ntohl(*(uint32_t *) (pkt + 24)) == (uint32_t) i);
+    }
+    assert(fread(rh, 1, 1, f) == 0);
+    fclose(f);
+    unlink(CAPTURE_FILE);
+    return 0;
+}
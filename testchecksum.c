@@ -0,0 +1,65 @@
+#include "stcp.h"
+#include <assert.h>
+
+/* The straightforward 16-bit checksum the fast paths must agree with */
+static unsigned short reference(unsigned char *data, int len) {
+    unsigned int sum = 0;
+    while (len > 1) {
+        sum += data[0] | (data[1] << 8);
+        data += 2;
+        len -= 2;
+    }
+    if (len > 0) sum += data[0];
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+int main(int argc, char **argv) {
+    static unsigned char buf[4096 + 8];
+
+    srandom(317);
+    for (int i = 0; i < sizeof(buf); i++) buf[i] = random();
+
+    /* Every length at every alignment, so each vector width and tail is hit */
+    for (int off = 0; off < 8; off++) {
+        for (int len = 0; len <= 4096; len++) {
+            assert(ipchecksum(buf + off, len) == reference(buf + off, len));
+        }
+    }
+
+    /* All ones is the worst case for carries */
+    unsigned char ones[4096];
+    memset(ones, 0xff, sizeof(ones));
+    assert(ipchecksum(ones, sizeof(ones)) == reference(ones, sizeof(ones)));
+
+    /* Header and payload summed apart give the same result */
+    assert(ipchecksumSplit(buf, 20, buf + 20, 1000) == ipchecksum(buf, 1020));
+    assert(ipchecksumSplit(buf, 20, buf + 20, 281) == ipchecksum(buf, 301));
+
+    /* A checksummed packet verifies to zero */
+    unsigned char pkt[STCP_MTU];
+    tcpheader *hdr = (tcpheader *) pkt;
+    memcpy(pkt, buf, sizeof(pkt));
+    hdr->checksum = 0;
+    hdr->checksum = ipchecksum(pkt, sizeof(pkt));
+    assert(ipchecksum(pkt, sizeof(pkt)) == 0);
+
+    /* Incremental updates match summing the whole packet again */
+    for (int i = 0; i < 1000; i++) {
+        unsigned short oldWindow = hdr->windowSize;
+        unsigned int oldAck = hdr->ackNo;
+
+        hdr->windowSize = random();
+        hdr->ackNo = random();
+        hdr->checksum = ipchecksumUpdate(hdr->checksum, oldWindow, hdr->windowSize);
+        hdr->checksum = ipchecksumUpdate32(hdr->checksum, oldAck, hdr->ackNo);
+        assert(ipchecksum(pkt, sizeof(pkt)) == 0);
+
+        unsigned short check = hdr->checksum;
+        hdr->checksum = 0;
+        assert(check == ipchecksum(pkt, sizeof(pkt)));
+        hdr->checksum = check;
+    }
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include "congestion.h"
+#include <assert.h>
+#include <string.h>
+
+#define MSS 1000
+
+/* Ack a full window every rtt ms, n times */
+static long rounds(const ccOps *ops, ccState *cc, int n, long time, long rtt) {
+    for (int i = 0; i < n; i++) {
+        time += rtt;
+        ops->onAck(cc, cc->cwnd, time);
+    }
+    return time;
+}
+
+int main(int argc, char **argv) {
+    ccState cc;
+
+    assert(ccLookup("newreno") == &ccNewReno);
+    assert(ccLookup("cubic") == &ccCubic);
+    assert(ccLookup("vegas") == NULL);
+
+    /* NewReno: slow start doubles, loss halves, avoidance adds a segment per round */
+    ccNewReno.init(&cc, MSS);
+    assert(cc.cwnd == 10 * MSS);
+    rounds(&ccNewReno, &cc, 3, 0, 10);
+    assert(cc.cwnd == 80 * MSS);
+    ccNewReno.onLoss(&cc, cc.cwnd, 40);
+    assert(cc.cwnd == 40 * MSS && cc.ssthresh == 40 * MSS);
+    rounds(&ccNewReno, &cc, 5, 40, 10);
+    assert(cc.cwnd == 45 * MSS);
+
+    /* A timeout falls back to one segment, and only the first one lowers ssthresh */
+    ccNewReno.onTimeout(&cc, 40 * MSS, 1, 100);
+    assert(cc.cwnd == MSS && cc.ssthresh == 20 * MSS);
+    ccNewReno.onTimeout(&cc, 40 * MSS, 0, 200);
+    assert(cc.cwnd == MSS && cc.ssthresh == 20 * MSS);
+    ccNewReno.onLoss(&cc, MSS, 300);
+    assert(cc.ssthresh == 2 * MSS);
+
+    /* Slow start stops at ssthresh */
+    ccNewReno.init(&cc, MSS);
+    cc.ssthresh = 15 * MSS;
+    ccNewReno.onAck(&cc, 10 * MSS, 10);
+    assert(cc.cwnd == 15 * MSS);
+
+    /* CUBIC: loss cuts to 70%, then growth flattens out near the old window */
+    ccCubic.init(&cc, MSS);
+    rounds(&ccCubic, &cc, 4, 0, 10);
+    assert(cc.cwnd == 160 * MSS);
+    ccCubic.onLoss(&cc, cc.cwnd, 40);
+    assert(cc.cwnd == 112 * MSS && cc.ssthresh == 112 * MSS);
+
+    /*
+     * K = cbrt(48 / 0.4) is about 4.9 s: by then cwnd is close to 160
+     * segments. With a 100 ms RTT Reno would only be at about 138.
+     */
+    long time = rounds(&ccCubic, &cc, 49, 40, 100);
+    assert(cc.cwnd > 150 * MSS && cc.cwnd <= 162 * MSS);
+
+    /* Past K it probes beyond the old window */
+    rounds(&ccCubic, &cc, 30, time, 100);
+    assert(cc.cwnd > 165 * MSS);
+
+    /* A loss before reaching the last maximum settles below it */
+    unsigned int before = cc.cwnd;
+    ccCubic.onLoss(&cc, cc.cwnd, 10000);
+    assert(cc.wMax == (double) before / MSS);
+    ccCubic.onLoss(&cc, cc.cwnd, 10010);
+    assert(cc.wMax < (double) before * 0.7 / MSS);
+
+    ccCubic.onTimeout(&cc, cc.cwnd, 1, 10020);
+    assert(cc.cwnd == MSS && cc.epochStart == 0);
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "stcp.h"
+#include <assert.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+/* A pair of UDP sockets on the loopback interface, connected to each other */
+static void socketPair(int *tx, int *rx) {
+    struct sockaddr_in a, b;
+    socklen_t len = sizeof(a);
+
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    b = a;
+    *tx = socket(AF_INET, SOCK_DGRAM, 0);
+    *rx = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(bind(*tx, (struct sockaddr *) &a, sizeof(a)) == 0);
+    assert(bind(*rx, (struct sockaddr *) &b, sizeof(b)) == 0);
+    assert(getsockname(*tx, (struct sockaddr *) &a, &len) == 0);
+    assert(getsockname(*rx, (struct sockaddr *) &b, &len) == 0);
+    assert(connect(*tx, (struct sockaddr *) &b, sizeof(b)) == 0);
+    assert(connect(*rx, (struct sockaddr *) &a, sizeof(a)) == 0);
+}
+
+/* Queue ten full datagrams and a short one, each with its own header */
+static void fill(packetBatch *batch, tcpheader *hdrs, unsigned char *payload) {
+    for (int i = 0; i < 11; i++) {
+        createHeader(&hdrs[i], ACK, STCP_MAXWIN, i * 1000, 0);
+        htonHdr(&hdrs[i]);
+        batchAdd(batch, &hdrs[i], sizeof(tcpheader), payload + i * 1000, i < 10 ? 1000 : 300);
+    }
+}
+
+int main(int argc, char **argv) {
+    static unsigned char payload[11000], buf[STCP_GRO_BUFFER];
+    static packetBatch batch;
+    tcpheader hdrs[11];
+    int tx, rx, segSize;
+
+    logConfig("testgso", "");
+    for (int i = 0; i < sizeof(payload); i++) payload[i] = i;
+    socketPair(&tx, &rx);
+
+    /* Without GRO the receiver sees every datagram on its own, whether sent with GSO or not */
+    for (int gso = 0; gso <= 1; gso++) {
+        batch.gso = gso && udpGsoSupported(tx);
+        fill(&batch, hdrs, payload);
+        assert(writeBatch(tx, &batch) == 11);
+        assert(batch.count == 0);
+
+        int got = 0;
+        while (got < 11) {
+            int n = readCoalesced(rx, buf, sizeof(buf), &segSize);
+            assert(n > 0);
+            assert(n == segSize);
+            assert(n == sizeof(tcpheader) + (got < 10 ? 1000 : 300));
+            assert(memcmp(buf + sizeof(tcpheader), payload + got * 1000, n - sizeof(tcpheader)) == 0);
+            got++;
+        }
+    }
+
+    /* With GRO a GSO send arrives as one buffer, cut at the segment size */
+    if (udpGsoSupported(tx) && udpEnableGro(rx) == 0) {
+        batch.gso = 1;
+        fill(&batch, hdrs, payload);
+        assert(writeBatch(tx, &batch) == 11);
+
+        int got = 0;
+        while (got < 11) {
+            int n = readCoalesced(rx, buf, sizeof(buf), &segSize);
+            assert(n > 0);
+            for (int off = 0; off < n; off += segSize, got++) {
+                tcpheader hdr = *(tcpheader *) (buf + off);
+                ntohHdr(&hdr);
+                assert(hdr.seqNo == got * 1000);
+                assert(min(segSize, n - off) == sizeof(tcpheader) + (got < 10 ? 1000 : 300));
+            }
+        }
+    }
+
+    close(tx);
+    close(rx);
+    return 0;
+}
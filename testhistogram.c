@@ -0,0 +1,49 @@
+#include "log.h"
+#include "histogram.h"
+#include <assert.h>
+#include <stdint.h>
+
+static histogram h;
+
+int main(int argc, char **argv) {
+    logConfig("testhistogram", "");
+
+    /* An empty histogram reports nothing */
+    histInit(&h);
+    assert(h.count == 0 && histPercentile(&h, 50) == 0);
+
+    /* Small values are exact */
+    for (int i = 1; i <= 20; i++) histRecord(&h, i);
+    assert(h.count == 20 && h.min == 1 && h.max == 20 && h.sum == 210);
+    assert(histPercentile(&h, 50) == 10);
+    assert(histPercentile(&h, 100) == 20);
+    assert(histPercentile(&h, 0) == 1);
+
+    /* Larger ones land within a bucket, about 3%, above their value */
+    histInit(&h);
+    for (uint64_t v = 1000; v <= 1000000; v += 1000) histRecord(&h, v);
+    uint64_t p50 = histPercentile(&h, 50);
+    uint64_t p99 = histPercentile(&h, 99);
+    assert(p50 >= 500000 && p50 <= 500000 + 500000 / HIST_SUB);
+    assert(p99 >= 990000 && p99 <= 990000 + 990000 / HIST_SUB);
+    assert(histPercentile(&h, 100) == 1000000);
+
+    /* Past the exact range buckets widen, two values at a time first */
+    histInit(&h);
+    histRecord(&h, HIST_SUB - 1);
+    histRecord(&h, 2 * HIST_SUB);
+    histRecord(&h, 2 * HIST_SUB + 1);
+    assert(histPercentile(&h, 34) == HIST_SUB - 1);
+    assert(histPercentile(&h, 67) == 2 * HIST_SUB + 1);
+
+    /* Values past the last magnitude are clamped, but max stays exact */
+    histInit(&h);
+    histRecord(&h, UINT64_MAX / 2);
+    assert(h.counts[HIST_BUCKETS - 1] == 1);
+    assert(histPercentile(&h, 99.9) == UINT64_MAX / 2);
+
+    /* The clock only moves forward */
+    uint64_t t = nowNs();
+    assert(nowNs() >= t && now() >= (long) (t / 1000000));
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include "log.h"
+#include <assert.h>
+
+static int evaluated = 0;
+
+static int sideEffect(void) {
+    return ++evaluated;
+}
+
+int main(int argc, char **argv) {
+    logConfig("testlog", "alpha,gamma");
+
+    /* Names resolve to one bit each, the same every time */
+    int alpha = logChannel("alpha");
+    assert(alpha == logChannel("alpha"));
+    assert(logChannel("beta") != alpha && logChannel("gamma") != alpha);
+    assert(logMask == (1ULL << alpha | 1ULL << logChannel("gamma")));
+
+    /* A disabled channel never evaluates its arguments */
+    assert(logOn("alpha") && logOn("gamma") && !logOn("beta"));
+    logLog("beta", "%d", sideEffect());
+    assert(evaluated == 0);
+    logLog("alpha", "%d", sideEffect());
+    assert(evaluated == 1);
+
+    /* Call sites keep working when the channels are configured again */
+    for (int i = 0; i < 2; i++) {
+        logConfig("testlog", i == 0 ? "beta" : "");
+        assert(!logOn("alpha") && logOn("beta") == (i == 0));
+    }
+
+    /* Channels past the last bit are accepted, and stay off */
+    char name[8];
+    for (int i = 0; i < LOG_MAX_CHANNELS + 2; i++) {
+        name[0] = 'c';
+        name[1] = '0' + i / 10;
+        name[2] = '0' + i % 10;
+        name[3] = '\0';
+        assert(logChannel(name) < LOG_MAX_CHANNELS);
+    }
+    logConfig("testlog", "c65");
+    assert(logMask == 0);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#include "pktpool.h"
+#include <assert.h>
+#include <stdint.h>
+
+int main(int argc, char **argv) {
+    pktPool pool;
+    void *blocks[3 * POOL_SLAB_BLOCKS];
+
+    assert(poolInit(&pool, 300) == 0);
+    assert(pool.blockSize % POOL_ALIGN == 0 && pool.blockSize >= 300);
+    assert(pool.capacity == POOL_SLAB_BLOCKS);
+
+    /* Buffers are aligned and distinct, and the pool grows on demand */
+    for (int i = 0; i < 3 * POOL_SLAB_BLOCKS; i++) {
+        unsigned char *b = poolAlloc(&pool);
+        assert(b != NULL);
+        assert((uintptr_t) b % POOL_ALIGN == 0);
+        for (int j = 0; j < i; j++) assert(blocks[j] != b);
+        b[0] = 0xff;
+        b[299] = 0xff;
+        blocks[i] = b;
+    }
+    assert(pool.capacity == 3 * POOL_SLAB_BLOCKS);
+    assert(pool.inUse == 3 * POOL_SLAB_BLOCKS);
+
+    /* Freed buffers are reused before the pool grows again */
+    for (int i = 0; i < 3 * POOL_SLAB_BLOCKS; i++) poolFree(&pool, blocks[i]);
+    assert(pool.inUse == 0);
+    for (int i = 0; i < 3 * POOL_SLAB_BLOCKS; i++) blocks[i] = poolAlloc(&pool);
+    assert(pool.capacity == 3 * POOL_SLAB_BLOCKS);
+
+    poolDestroy(&pool);
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "reassembly.h"
+#include "wraparound.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIZE 4096
+#define SEGMENT 100
+
+/* Drain into out, returning the bytes drained */
+static int drain(reasmBuffer *ra, unsigned char *out) {
+    struct iovec iov[2];
+    int count;
+    int n = reasmDrain(ra, iov, &count);
+    int copied = 0;
+
+    for (int i = 0; i < count; i++) {
+        memcpy(out + copied, iov[i].iov_base, iov[i].iov_len);
+        copied += iov[i].iov_len;
+    }
+    assert(copied == n);
+    return n;
+}
+
+int main(int argc, char **argv) {
+    reasmBuffer ra;
+    unsigned char in[3 * SIZE];
+    unsigned char out[3 * SIZE];
+
+    for (int i = 0; i < (int) sizeof(in); i++) in[i] = random();
+
+    /* The ring rounds up to a power of two */
+    assert(reasmInit(&ra, 5000, 0) == 0);
+    assert(ra.size == 8192);
+    reasmFree(&ra);
+
+    /* Sequence numbers that wrap, and a ring position that does too */
+    unsigned int isn = 0xffffffff - 1000;
+    assert(reasmInit(&ra, SIZE, isn) == 0);
+
+    /* Nothing is drained past a hole, then the prefix comes out at once */
+    assert(reasmInsert(&ra, plus32(isn, SEGMENT), in + SEGMENT, SEGMENT) == SEGMENT);
+    assert(reasmInsert(&ra, plus32(isn, 3 * SEGMENT), in + 3 * SEGMENT, SEGMENT) == SEGMENT);
+    assert(drain(&ra, out) == 0);
+    unsigned int blocks[4][2];
+    assert(reasmBlocks(&ra, blocks, 4) == 2);
+    assert(blocks[0][0] == plus32(isn, SEGMENT) && blocks[0][1] == plus32(isn, 2 * SEGMENT));
+    assert(blocks[1][0] == plus32(isn, 3 * SEGMENT) && blocks[1][1] == plus32(isn, 4 * SEGMENT));
+    assert(reasmBlocks(&ra, blocks, 1) == 1);
+    assert(reasmInsert(&ra, plus32(isn, SEGMENT), in + SEGMENT, SEGMENT) == 0);
+    assert(reasmInsert(&ra, isn, in, SEGMENT) == SEGMENT);
+    assert(drain(&ra, out) == 2 * SEGMENT);
+    assert(memcmp(out, in, 2 * SEGMENT) == 0);
+    assert(ra.start == plus32(isn, 2 * SEGMENT));
+
+    /* Overlaps only count what is new, and bytes already drained are ignored */
+    assert(reasmInsert(&ra, plus32(isn, SEGMENT), in + SEGMENT, 2 * SEGMENT) == SEGMENT);
+    assert(drain(&ra, out) == 2 * SEGMENT);
+    assert(memcmp(out, in + 2 * SEGMENT, 2 * SEGMENT) == 0);
+
+    /* Data delivered around the ring is skipped, along with what was held for it */
+    assert(reasmInsert(&ra, plus32(isn, 5 * SEGMENT), in + 5 * SEGMENT, SEGMENT) == SEGMENT);
+    reasmSkip(&ra, plus32(isn, 6 * SEGMENT));
+    assert(drain(&ra, out) == 0);
+    assert(ra.start == plus32(isn, 6 * SEGMENT));
+
+    /* Segments in a random order, with duplicates, come out whole */
+    unsigned int base = ra.start;
+    int total = 80 * SEGMENT;
+    int drained = 0;
+    for (int round = 0; drained < total; round++) {
+        int off = drained + (random() % (SIZE / SEGMENT)) * SEGMENT;
+        if (off + SEGMENT <= total && off + SEGMENT <= drained + SIZE) {
+            reasmInsert(&ra, plus32(base, off), in + off, SEGMENT);
+        }
+        int n = drain(&ra, out + drained);
+        assert(memcmp(out + drained, in + drained, n) == 0);
+        drained += n;
+        assert(round < 100000);
+    }
+    assert(ra.start == plus32(base, total));
+
+    /* Nothing past the end of the ring is kept, not even when it starts there */
+    assert(reasmInsert(&ra, plus32(ra.start, SIZE), in, SEGMENT) == 0);
+    assert(reasmInsert(&ra, plus32(ra.start, 2 * SIZE), in, SEGMENT) == 0);
+    assert(reasmInsert(&ra, plus32(ra.start, SIZE - SEGMENT), in, 2 * SEGMENT) == SEGMENT);
+    assert(ra.end == plus32(ra.start, SIZE));
+    reasmFree(&ra);
+    return 0;
+}
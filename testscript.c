@@ -0,0 +1,77 @@
+#include "script.h"
+#include "log.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char **argv) {
+    script s;
+    int delay = 0;
+
+    logConfig("testscript", "");
+
+    /* The statements of the shipped scripts */
+    scriptInit(&s);
+    assert(scriptParse(&s,
+                       "// Delay the first incoming and outgoing SYN segments\n"
+                       "in syn 1 delay 900\n"
+                       "out syn 1 delay 300\n"
+                       "in data #3 drop\n"
+                       "drop ack 20%\n"
+                       "corrupt in data 30 %\n"
+                       "swap out fin 100%\n"
+                       "consume 70%   // slow application\n") == 0);
+    assert(s.eventCount == 3);
+    assert(s.percent[SCRIPT_IN][SCRIPT_ACK][SCRIPT_DROP] == 20);
+    assert(s.percent[SCRIPT_OUT][SCRIPT_ACK][SCRIPT_DROP] == 20);
+    assert(s.percent[SCRIPT_IN][SCRIPT_DATA][SCRIPT_CORRUPT] == 30);
+    assert(s.percent[SCRIPT_OUT][SCRIPT_DATA][SCRIPT_CORRUPT] == 0);
+    assert(s.percent[SCRIPT_OUT][SCRIPT_FIN][SCRIPT_SWAP] == 100);
+    assert(s.consumePercent == 70);
+
+    /* Ordinals count per direction and type, from 1 */
+    assert(scriptAction(&s, SCRIPT_IN, SCRIPT_SYN, &delay) == SCRIPT_DELAY && delay == 900);
+    assert(scriptAction(&s, SCRIPT_IN, SCRIPT_SYN, &delay) == SCRIPT_PASS);
+    assert(scriptAction(&s, SCRIPT_OUT, SCRIPT_SYN, &delay) == SCRIPT_DELAY && delay == 300);
+    srandom(1);
+    int corrupted = 0;
+    for (int i = 1; i <= 1000; i++) {
+        int action = scriptAction(&s, SCRIPT_IN, SCRIPT_DATA, &delay);
+        if (i == 3) assert(action == SCRIPT_DROP);
+        else assert(action == SCRIPT_PASS || action == SCRIPT_CORRUPT);
+        corrupted += action == SCRIPT_CORRUPT;
+    }
+    assert(corrupted > 250 && corrupted < 350);
+    assert(scriptAction(&s, SCRIPT_OUT, SCRIPT_FIN, &delay) == SCRIPT_SWAP);
+    scriptFree(&s);
+    assert(s.eventCount == 0 && s.events == NULL);
+
+    /* Malformed statements are refused */
+    const char *bad[] = { "drop data", "drop up data 20%", "drop data 120%", "in syn 0 drop",
+                          "in syn 1 delay", "out ack 2 pass", "consume", "bogus" };
+    for (int i = 0; i < (int) (sizeof(bad) / sizeof(bad[0])); i++) {
+        scriptInit(&s);
+        assert(scriptParse(&s, bad[i]) == -1);
+        scriptFree(&s);
+    }
+
+    /* A segment is DATA if it has a payload, then FIN, SYN and ACK */
+    tcpheader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.dataOffset = sizeof(tcpheader) / 4;
+    hdr.flags = FIN | ACK;
+    assert(scriptClassify(&hdr, sizeof(tcpheader)) == SCRIPT_FIN);
+    assert(scriptClassify(&hdr, sizeof(tcpheader) + 1) == SCRIPT_DATA);
+    hdr.flags = SYN | ACK;
+    hdr.dataOffset = 7;
+    assert(scriptClassify(&hdr, 28) == SCRIPT_SYN);
+    hdr.flags = ACK;
+    hdr.dataOffset = sizeof(tcpheader) / 4;
+    assert(scriptClassify(&hdr, sizeof(tcpheader)) == SCRIPT_ACK);
+
+    /* Senders that predate options leave dataOffset 0 */
+    hdr.dataOffset = 0;
+    assert(scriptClassify(&hdr, sizeof(tcpheader)) == SCRIPT_ACK);
+    assert(scriptClassify(&hdr, sizeof(tcpheader) + 1) == SCRIPT_DATA);
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "log.h"
+#include "stats.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define STATS_FILE "teststats.json"
+#define STATS_SOCKET "teststats.sock"
+
+static stcp_stats live;
+static int samples = 0;
+
+static void sample(void *arg, stcp_stats *stats) {
+    statsSnapshot(stats, arg);
+    samples++;
+}
+
+static void readFile(const char *name, char *buf, int size) {
+    FILE *f = fopen(name, "r");
+    assert(f != NULL);
+    int n = fread(buf, 1, size - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+}
+
+int main(int argc, char **argv) {
+    char line[STATS_JSON_MAX];
+    stcp_stats copy;
+
+    logConfig("teststats", "");
+
+    /* Counters only ever move by what was added; snapshots copy every field */
+    statsAdd(live.segmentsSent, 3);
+    statsAdd(live.segmentsSent, 4);
+    statsSet(live.cwnd, 14520);
+    statsSet(live.rto, (uint64_t) -1);
+    statsSnapshot(&copy, &live);
+    assert(memcmp(&copy, &live, sizeof(live)) == 0);
+    assert(copy.segmentsSent == 7 && copy.cwnd == 14520);
+
+    /* One line of JSON, every field included */
+    int len = statsJson(&copy, line, sizeof(line));
+    assert(len > 0 && line[0] == '{' && line[len - 1] == '\n' && line[len - 2] == '}');
+    assert(strstr(line, "\"segmentsSent\":7,") && strstr(line, "\"cwnd\":14520,"));
+    assert(strstr(line, "\"rto\":18446744073709551615}"));
+    assert(statsJson(&copy, line, 16) == -1);
+
+    /* A file is replaced on every interval, and once more at the end */
+    unlink(STATS_FILE);
+    statsExporter *e = statsExportStart(STATS_FILE, 10, sample, &live);
+    assert(e != NULL);
+    usleep(100 * 1000);
+    statsAdd(live.timeouts, 1);
+    statsExportStop(e);
+    assert(samples >= 2);
+    readFile(STATS_FILE, line, sizeof(line));
+    assert(strstr(line, "\"timeouts\":1,") && strchr(line, '\n') == line + strlen(line) - 1);
+    assert(access(STATS_FILE ".tmp", F_OK) < 0);
+    unlink(STATS_FILE);
+
+    /* A socket gets one datagram per sample; those sent before it was bound are dropped */
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, STATS_SOCKET);
+    unlink(STATS_SOCKET);
+    e = statsExportStart(STATS_UNIX_PREFIX STATS_SOCKET, 10, sample, &live);
+    assert(e != NULL);
+    usleep(30 * 1000);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    assert(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    samples = 0;
+    statsExportStop(e);
+    assert(samples >= 1);
+    len = recv(fd, line, sizeof(line) - 1, MSG_DONTWAIT);
+    assert(len > 0);
+    line[len] = '\0';
+    assert(line[0] == '{' && strstr(line, "\"segmentsSent\":7,"));
+    close(fd);
+    unlink(STATS_SOCKET);
+    return 0;
+}
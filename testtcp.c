@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
+#include <assert.h>
 #include "tcp.h"
 
 int main(int argc, char **argv) {
@@ -21,5 +23,40 @@ int main(int argc, char **argv) {
     printf("%s\n", tcpHdrToString(&hdr));
     ntohHdr(&hdr);
     printf("%s\n", tcpHdrToString(&hdr));
+
+    /* Options round trip, and a header that only claims to have them has none */
+    unsigned char pkt[sizeof(tcpheader) + TCP_MAX_OPTIONS];
+    tcpoptions opts = { .mss = 1452, .hasWscale = 1, .wscale = 7 };
+    bzero(pkt, sizeof(pkt));
+    int optLen = tcpWriteOptions(pkt + sizeof(tcpheader), &opts);
+    assert(optLen == 8);
+    ((tcpheader *) pkt)->dataOffset = (sizeof(tcpheader) + optLen) / 4;
+    bzero(&opts, sizeof(opts));
+    assert(tcpParseOptions(pkt, sizeof(tcpheader) + optLen, &opts) == 0);
+    assert(opts.mss == 1452 && opts.hasWscale && opts.wscale == 7);
+    assert(tcpParseOptions(pkt, sizeof(tcpheader), &opts) == 0);
+    assert(opts.mss == 0 && !opts.hasWscale);
+    pkt[sizeof(tcpheader) + 1] = 9;
+    assert(tcpParseOptions(pkt, sizeof(tcpheader) + optLen, &opts) == -1);
+
+    /* SACK-permitted on a SYN, and the most blocks an ACK has room for */
+    tcpoptions syn = { .mss = 1452, .hasWscale = 1, .sackPermitted = 1 };
+    optLen = tcpWriteOptions(pkt + sizeof(tcpheader), &syn);
+    assert(optLen == 12);
+    ((tcpheader *) pkt)->dataOffset = (sizeof(tcpheader) + optLen) / 4;
+    assert(tcpParseOptions(pkt, sizeof(tcpheader) + optLen, &opts) == 0);
+    assert(opts.sackPermitted && opts.sackBlocks == 0 && opts.mss == 1452);
+
+    tcpoptions ack = { .sackBlocks = TCP_MAX_SACK };
+    for (int b = 0; b < TCP_MAX_SACK; b++) {
+        ack.sack[b][0] = 0xfffff000u + b * 0x1000;
+        ack.sack[b][1] = 0xfffff800u + b * 0x1000;
+    }
+    optLen = tcpWriteOptions(pkt + sizeof(tcpheader), &ack);
+    assert(optLen == 36 && optLen <= TCP_MAX_OPTIONS);
+    ((tcpheader *) pkt)->dataOffset = (sizeof(tcpheader) + optLen) / 4;
+    assert(tcpParseOptions(pkt, sizeof(tcpheader) + optLen, &opts) == 0);
+    assert(!opts.sackPermitted && opts.sackBlocks == TCP_MAX_SACK);
+    assert(memcmp(opts.sack, ack.sack, sizeof(ack.sack)) == 0);
     return 0;
 }
@@ -0,0 +1,69 @@
+#include "timerwheel.h"
+#include <assert.h>
+
+int main(int argc, char **argv) {
+    timerWheel tw;
+    twTimer a = {0}, b = {0}, c = {0}, far = {0};
+
+    twInit(&tw, 1000);
+    assert(twNextExpiry(&tw) == -1);
+    assert(twExpired(&tw, 5000) == NULL);
+    assert(tw.now == 5000);
+
+    twSchedule(&tw, &a, 5010);
+    twSchedule(&tw, &b, 5005);
+    twSchedule(&tw, &c, 5010);
+    twSchedule(&tw, &far, 5000 + 3 * TW_SLOTS + 7);
+    assert(tw.count == 4);
+    assert(twNextExpiry(&tw) == 5005);
+
+    /* Nothing is due yet */
+    assert(twExpired(&tw, 5004) == NULL);
+
+    assert(twExpired(&tw, 5005) == &b);
+    assert(twExpired(&tw, 5005) == NULL);
+    assert(twNextExpiry(&tw) == 5010);
+
+    /* Cancelling is O(1) and idempotent */
+    twCancel(&tw, &c);
+    twCancel(&tw, &c);
+    assert(!twPending(&c));
+    assert(tw.count == 2);
+
+    /* Rescheduling moves a pending timer */
+    twSchedule(&tw, &a, 5020);
+    assert(tw.count == 2);
+    assert(twExpired(&tw, 5015) == NULL);
+    assert(twExpired(&tw, 5030) == &a);
+
+    /* Timers more than one revolution out only expire on their own round */
+    assert(twNextExpiry(&tw) == 5000 + 3 * TW_SLOTS + 7);
+    assert(twExpired(&tw, 5000 + 2 * TW_SLOTS + 7) == NULL);
+    assert(twPending(&far));
+    assert(twExpired(&tw, 5000 + 4 * TW_SLOTS) == &far);
+    assert(tw.count == 0);
+
+    /* Cancelling the earliest timer finds the next one, however many were scheduled */
+    twTimer many[100] = {{0}};
+    for (int i = 0; i < 100; i++) twSchedule(&tw, &many[i], tw.now + 100 + i);
+    for (int i = 0; i < 100; i++) {
+        assert(twNextExpiry(&tw) == tw.now + 100 + i);
+        twCancel(&tw, &many[i]);
+    }
+    assert(twNextExpiry(&tw) == -1);
+
+    /* An earlier timer scheduled later still comes first */
+    twSchedule(&tw, &a, tw.now + 50);
+    assert(twNextExpiry(&tw) == tw.now + 50);
+    twSchedule(&tw, &b, tw.now + 20);
+    assert(twNextExpiry(&tw) == tw.now + 20);
+    twCancel(&tw, &b);
+    assert(twNextExpiry(&tw) == tw.now + 50);
+    twCancel(&tw, &a);
+
+    /* A deadline already in the past expires immediately */
+    twSchedule(&tw, &a, 10);
+    assert(twNextExpiry(&tw) == tw.now);
+    assert(twExpired(&tw, tw.now) == &a);
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include "log.h"
+#include "trace.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define THREADS 4
+#define RECORDS 20000
+#define TRACE_FILE "testtrace.out"
+#define RINGS 128                       /* each thread of every round gets its own */
+
+static int accepted[THREADS];
+
+/* Writes until tracing stops under it, counting the records taken */
+static void *racer(void *arg) {
+    long t = (long) arg;
+    for (int i = 0; i < RECORDS; i++) {
+        if (!traceWrite(logChannel("test"), TRACE_SENT, 0, i, t, 0, 0)) break;
+        accepted[t]++;
+    }
+    return NULL;
+}
+
+/*
+ * Read a trace back, checking that every record comes in its thread's
+ * order, and count the records of each thread and those lost per ring.
+ */
+static FILE *readTrace(unsigned int *received, unsigned int *lost, int *ringOf, traceRecord *rec) {
+    FILE *f = fopen(TRACE_FILE, "rb");
+    unsigned int next[THREADS] = { 0 };
+
+    assert(f != NULL);
+    assert(fread(rec, sizeof(*rec), 1, f) == 1);
+    assert(rec->event == TRACE_START && rec->seq == TRACE_MAGIC && rec->ack == TRACE_VERSION);
+    memset(ringOf, -1, THREADS * sizeof(int));
+    while (fread(rec, sizeof(*rec), 1, f) == 1 && rec->event != TRACE_CHANNELS) {
+        assert(rec->thread < RINGS);
+        if (rec->event == TRACE_LOST) {
+            lost[rec->thread] += rec->len;
+            continue;
+        }
+        assert(rec->event == TRACE_SENT && rec->channel == logChannel("test") && rec->ack < THREADS);
+        assert(ringOf[rec->ack] == -1 || ringOf[rec->ack] == (int) rec->thread);
+        ringOf[rec->ack] = rec->thread;
+        assert(rec->seq >= next[rec->ack]);
+        next[rec->ack] = rec->seq + 1;
+        received[rec->ack]++;
+    }
+    assert(rec->event == TRACE_CHANNELS);
+    return f;
+}
+
+static void *producer(void *arg) {
+    for (int i = 0; i < RECORDS; i++) {
+        traceLog("test", TRACE_SENT, 0, i, (unsigned int) (long) arg, 0, 0);
+        if (i % 1000 == 0) usleep(1000);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    pthread_t threads[THREADS];
+
+    logConfig("testtrace", "");
+
+    /* Nothing is recorded, or even looked up, until tracing starts */
+    traceLog("early", TRACE_SENT, 0, 0, 0, 0, 0);
+    assert(traceStart(TRACE_FILE) == 0);
+    assert(traceStart(TRACE_FILE) == -1);
+    for (long t = 0; t < THREADS; t++) assert(pthread_create(&threads[t], NULL, producer, (void *) t) == 0);
+    for (int t = 0; t < THREADS; t++) pthread_join(threads[t], NULL);
+    traceStop();
+
+    /* Every record comes back in its thread's order, or is counted as lost */
+    traceRecord rec;
+    unsigned int received[THREADS] = { 0 };
+    unsigned int lost[RINGS] = { 0 };
+    int ringOf[THREADS];
+    FILE *f = readTrace(received, lost, ringOf, &rec);
+    for (int t = 0; t < THREADS; t++) {
+        assert(ringOf[t] >= 0 && received[t] + lost[ringOf[t]] == RECORDS);
+    }
+
+    /* Then the channel names, one per line by bit */
+    char names[256];
+    assert(rec.len < sizeof(names) && fread(names, 1, rec.len, f) == rec.len);
+    names[rec.len] = '\0';
+    assert(strcmp(names, "test\n") == 0);
+    fclose(f);
+
+    /* Stopping under running writers keeps every record it let in */
+    for (int round = 0; round < 20; round++) {
+        memset(accepted, 0, sizeof(accepted));
+        memset(received, 0, sizeof(received));
+        memset(lost, 0, sizeof(lost));
+        assert(traceStart(TRACE_FILE) == 0);
+        for (long t = 0; t < THREADS; t++) assert(pthread_create(&threads[t], NULL, racer, (void *) t) == 0);
+        usleep(round * 100);
+        traceStop();
+        for (int t = 0; t < THREADS; t++) pthread_join(threads[t], NULL);
+
+        fclose(readTrace(received, lost, ringOf, &rec));
+        for (int t = 0; t < THREADS; t++) {
+            assert(received[t] + (ringOf[t] >= 0 ? lost[ringOf[t]] : 0) == (unsigned int) accepted[t]);
+        }
+    }
+    unlink(TRACE_FILE);
+    return 0;
+}
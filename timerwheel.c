@@ -0,0 +1,106 @@
+/*
+ * Hashed timer wheel for the STCP sender's retransmission timers.
+ */
+
+#include <string.h>
+#include "timerwheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+
+void twInit(timerWheel *tw, long now) {
+    memset(tw, 0, sizeof(*tw));
+    tw->now = now;
+    tw->next = now;
+}
+
+/*
+ * Schedule (or reschedule) t to expire at the absolute time expires.
+ * A time already in the past expires on the next call to twExpired().
+ */
+void twSchedule(timerWheel *tw, twTimer *t, long expires) {
+    twCancel(tw, t);
+
+    long tick = expires < tw->now ? tw->now : expires;
+    twTimer **slot = &tw->slots[tick & TW_MASK];
+
+    t->expires = expires;
+    t->next = *slot;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+
+    /* Every other timer is due at tw->next or later */
+    if (tw->count++ == 0 || tick <= tw->next) {
+        tw->next = tick;
+        tw->nextExact = 1;
+    }
+}
+
+/*
+ * Remove t from the wheel. Cancelling a timer that is not scheduled is
+ * harmless.
+ */
+void twCancel(timerWheel *tw, twTimer *t) {
+    if (!twPending(t)) return;
+
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+    tw->count--;
+    if (t->expires <= tw->next) tw->nextExact = 0;
+}
+
+/*
+ * Remove and return one timer that is due at time now, or NULL once none
+ * are left. Call repeatedly to expire everything that is due.
+ */
+twTimer *twExpired(timerWheel *tw, long now) {
+    long steps = 0;
+
+    while (tw->count > 0) {
+        for (twTimer *t = tw->slots[tw->now & TW_MASK]; t; t = t->next) {
+            if (t->expires <= now) {
+                twCancel(tw, t);
+                return t;
+            }
+        }
+        if (tw->now >= now) return NULL;
+
+        /* One full revolution has looked at every slot, skip the rest */
+        if (++steps >= TW_SLOTS) break;
+        tw->now++;
+    }
+    if (tw->now < now) tw->now = now;
+    return NULL;
+}
+
+/*
+ * Return the absolute time at which the next timer expires, or -1 if
+ * none is scheduled.
+ */
+long twNextExpiry(timerWheel *tw) {
+    if (tw->count == 0) return -1;
+    if (tw->nextExact) return tw->next;
+
+    for (long tick = tw->next > tw->now ? tw->next : tw->now; tick < tw->now + TW_SLOTS; tick++) {
+        for (twTimer *t = tw->slots[tick & TW_MASK]; t; t = t->next) {
+            if (t->expires <= tick) {
+                tw->next = tick;
+                tw->nextExact = 1;
+                return tick;
+            }
+        }
+    }
+
+    /* Everything is at least one revolution away */
+    long earliest = -1;
+    for (int i = 0; i < TW_SLOTS; i++) {
+        for (twTimer *t = tw->slots[i]; t; t = t->next) {
+            if (earliest < 0 || t->expires < earliest) earliest = t->expires;
+        }
+    }
+    tw->next = earliest;
+    tw->nextExact = 1;
+    return earliest;
+}
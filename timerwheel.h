@@ -0,0 +1,47 @@
+#ifndef __TIMERWHEEL_H__
+#define __TIMERWHEEL_H__
+#include <stddef.h>
+
+/*
+ * A hashed timer wheel with one slot per millisecond. Timers hash into
+ * slot (expires % TW_SLOTS), so scheduling and cancelling are O(1) list
+ * operations, and expiring only looks at the slots the clock has moved
+ * past. Timers further out than one revolution stay in their slot until
+ * the wheel comes round to them again.
+ *
+ * The wheel also remembers a tick no timer is due before, and whether
+ * one is due at it. twNextExpiry() answers from that while it holds,
+ * and otherwise scans forward from it rather than from now. Cancelling
+ * the earliest timer, as every ACK does, then only costs a scan over
+ * the ticks up to the next one.
+ *
+ * A twTimer is embedded in whatever it times; use twEntry() to get back
+ * to the enclosing structure from an expired timer.
+ */
+
+#define TW_SLOTS 4096               /* must be a power of two */
+
+typedef struct twTimer {
+    struct twTimer *next;
+    struct twTimer **pprev;         /* NULL while the timer is not scheduled */
+    long expires;                   /* absolute time in ms */
+} twTimer;
+
+typedef struct {
+    twTimer *slots[TW_SLOTS];
+    long now;                       /* every slot before this tick has been expired */
+    long next;                      /* no timer is due before this tick */
+    int nextExact;                  /* and one is due at it */
+    int count;
+} timerWheel;
+
+#define twEntry(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+static inline int twPending(twTimer *t) { return t->pprev != NULL; }
+
+extern void twInit(timerWheel *tw, long now);
+extern void twSchedule(timerWheel *tw, twTimer *t, long expires);
+extern void twCancel(timerWheel *tw, twTimer *t);
+extern twTimer *twExpired(timerWheel *tw, long now);
+extern long twNextExpiry(timerWheel *tw);
+#endif
@@ -0,0 +1,211 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "trace.h"
+
+#define RING_MASK (TRACE_RING_RECORDS - 1)
+
+/*
+ * One thread's records. Only the owner moves head and only the drain
+ * thread moves tail, so each side publishes its index with a release
+ * store and reads the other's with an acquire load.
+ *
+ * writing is raised while the owner appends a record. The owner raises
+ * it before it checks traceActive, and traceStop() clears traceActive
+ * before it waits for every writing flag to drop. Both sides use
+ * sequentially consistent accesses, so after that wait no record can
+ * arrive behind the final drain.
+ */
+typedef struct traceRing {
+    traceRecord records[TRACE_RING_RECORDS];
+    unsigned int head;                  /* next record the owner writes */
+    unsigned int tail;                  /* next record the drain thread takes */
+    unsigned int dropped;               /* records lost to a full ring */
+    unsigned int reported;              /* of those, already noted in the file */
+    int writing;                        /* the owner is inside traceWrite() */
+    int id;
+    struct traceRing *next;
+} traceRing;
+
+int traceActive = 0;
+
+static traceRing *rings = NULL;         /* every ring, newest first */
+static int ringCount = 0;
+static __thread traceRing *myRing = NULL;
+static int traceFd = -1;
+static int stopping = 0;
+static pthread_t drainThread;
+
+/*
+ * Give the calling thread its ring and link it in where the drain
+ * thread will find it.
+ */
+static traceRing *ringCreate(void) {
+    traceRing *r = calloc(1, sizeof(traceRing));
+    if (r == NULL) return NULL;
+
+    r->id = __atomic_fetch_add(&ringCount, 1, __ATOMIC_RELAXED);
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    }
+    myRing = r;
+    return r;
+}
+
+/*
+ * Append a record to the calling thread's ring, or count it as dropped
+ * if the ring is full. Returns 1 if the record was taken either way, or
+ * 0 if tracing is off.
+ */
+int traceWrite(int channel, int event, int flags, uint32_t seq, uint32_t ack,
+                uint32_t len, uint32_t window) {
+    traceRing *r = myRing ? myRing : ringCreate();
+    if (r == NULL) return 0;
+
+    __atomic_store_n(&r->writing, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&traceActive, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&r->writing, 0, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    unsigned int head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == TRACE_RING_RECORDS) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->writing, 0, __ATOMIC_RELEASE);
+        return 1;
+    }
+
+    traceRecord *rec = &r->records[head & RING_MASK];
+    rec->time = nowNs();
+    rec->thread = r->id;
+    rec->channel = channel;
+    rec->event = event;
+    rec->flags = flags;
+    rec->seq = seq;
+    rec->ack = ack;
+    rec->len = len;
+    rec->window = window;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->writing, 0, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void writeAll(const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(traceFd, p, len);
+        if (n <= 0) return;
+        p += n;
+        len -= n;
+    }
+}
+
+static void writeRecord(int thread, int event, uint32_t seq, uint32_t ack, uint32_t len) {
+    traceRecord rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.time = nowNs();
+    rec.thread = thread;
+    rec.event = event;
+    rec.seq = seq;
+    rec.ack = ack;
+    rec.len = len;
+    writeAll(&rec, sizeof(rec));
+}
+
+/*
+ * Write out everything the rings hold, at most two spans per ring.
+ */
+static void drain(void) {
+    for (traceRing *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned int tail = r->tail;
+        unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned int n = head - tail;
+        unsigned int pos = tail & RING_MASK;
+        unsigned int first = TRACE_RING_RECORDS - pos < n ? TRACE_RING_RECORDS - pos : n;
+
+        writeAll(&r->records[pos], first * sizeof(traceRecord));
+        writeAll(&r->records[0], (n - first) * sizeof(traceRecord));
+        __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+
+        unsigned int dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        if (dropped != r->reported) {
+            writeRecord(r->id, TRACE_LOST, 0, 0, dropped - r->reported);
+            r->reported = dropped;
+        }
+    }
+}
+
+static void *drainMain(void *arg) {
+    struct timespec interval = { 0, TRACE_DRAIN_INTERVAL * 1000000L };
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+        drain();
+    }
+    return NULL;
+}
+
+/*
+ * Start tracing to fileName, replacing whatever it held. The trace is
+ * stopped and completed at exit if traceStop() is not called first.
+ * Returns 0, or -1 if the file cannot be created or tracing is on.
+ */
+int traceStart(const char *fileName) {
+    static int atexitDone = 0;
+
+    if (traceActive) return -1;
+    traceFd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (traceFd < 0) {
+        logPerror((char *) fileName);
+        return -1;
+    }
+    writeRecord(0, TRACE_START, TRACE_MAGIC, TRACE_VERSION, sizeof(traceRecord));
+
+    stopping = 0;
+    if (pthread_create(&drainThread, NULL, drainMain, NULL) != 0) {
+        logLog("failure", "Cannot start the trace drain thread");
+        close(traceFd);
+        traceFd = -1;
+        return -1;
+    }
+    if (!atexitDone) atexit(traceStop);
+    atexitDone = 1;
+    __atomic_store_n(&traceActive, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Stop tracing: wait for records being written to land, drain what is
+ * left, append the channel names and close the file.
+ */
+void traceStop(void) {
+    if (!traceActive) return;
+    __atomic_store_n(&traceActive, 0, __ATOMIC_SEQ_CST);
+    for (traceRing *r = __atomic_load_n(&rings, __ATOMIC_SEQ_CST); r; r = r->next) {
+        while (__atomic_load_n(&r->writing, __ATOMIC_SEQ_CST)) sched_yield();
+    }
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(drainThread, NULL);
+    drain();
+
+    char names[LOG_MAX_CHANNELS * 32];
+    int len = 0;
+    const char *name;
+    for (int i = 0; (name = logChannelName(i)) != NULL; i++) {
+        len += snprintf(names + len, sizeof(names) - len, "%s\n", name);
+        if (len >= (int) sizeof(names)) {
+            len = sizeof(names) - 1;
+            break;
+        }
+    }
+    writeRecord(0, TRACE_CHANNELS, 0, 0, len);
+    writeAll(names, len);
+    close(traceFd);
+    traceFd = -1;
+}
@@ -0,0 +1,70 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+#include <stdint.h>
+
+/*
+ * Binary tracing for production use. Each thread appends fixed-size
+ * records to a ring of its own, with no lock and no formatting, and a
+ * background thread drains every ring to a file now and then. The
+ * tracedump tool turns the file back into text.
+ *
+ * A full ring drops records rather than wait; the drain thread notes
+ * how many went missing in a TRACE_LOST record. Rings are created on a
+ * thread's first record and live until the process exits.
+ *
+ * The file starts with a TRACE_START record, and traceStop() ends it
+ * with a TRACE_CHANNELS record followed by len bytes of channel names,
+ * one per line in logChannel() order.
+ */
+
+#define TRACE_RING_RECORDS 4096         /* per thread, a power of two */
+#define TRACE_DRAIN_INTERVAL 10         /* ms between passes of the drain thread */
+#define TRACE_MAGIC 0x53545243          /* "STRC", in the seq of TRACE_START */
+#define TRACE_VERSION 1
+
+/* Events */
+#define TRACE_START 'S'                 /* seq magic, ack version, len record size */
+#define TRACE_CHANNELS 'C'              /* len bytes of channel names follow */
+#define TRACE_LOST 'L'                  /* len records dropped by thread */
+#define TRACE_SENT 's'                  /* a segment was sent */
+#define TRACE_RECEIVED 'r'              /* a segment was received */
+#define TRACE_RETRANSMIT 'R'            /* seq resent; ack windowStart, window cwnd */
+#define TRACE_TIMEOUT 'T'               /* seq timed out; len its timeout in ms, window cwnd */
+
+typedef struct {
+    uint64_t time;                      /* nowNs(): ns since an arbitrary point   */
+    uint32_t thread;                    /* ring the record came from, from 0 */
+    uint16_t channel;                   /* logChannel() bit */
+    uint8_t event;
+    uint8_t flags;                      /* TCP flags, for segments */
+    uint32_t seq;
+    uint32_t ack;
+    uint32_t len;
+    uint32_t window;
+} traceRecord;
+
+extern int traceActive;
+
+extern int traceStart(const char *fileName);
+extern void traceStop(void);
+extern int traceWrite(int channel, int event, int flags, uint32_t seq, uint32_t ack,
+                       uint32_t len, uint32_t window);
+
+/*
+ * Record an event on a channel, if tracing is on. Like logLog(), the
+ * channel's bit is looked up once per call site, and cached atomically
+ * since any tracing thread may fill it in first.
+ */
+#define traceLog(channel, event, flags, seq, ack, len, window) do {                  \
+        if (__atomic_load_n(&traceActive, __ATOMIC_RELAXED)) {                     \
+            static int traceId_ = -1;                                               \
+            int id_ = __atomic_load_n(&traceId_, __ATOMIC_RELAXED);                 \
+            if (id_ < 0) {                                                          \
+                id_ = logChannel(channel);                                          \
+                __atomic_store_n(&traceId_, id_, __ATOMIC_RELAXED);                 \
+            }                                                                       \
+            traceWrite(id_, event, flags, seq, ack, len, window);                   \
+        }                                                                           \
+    } while (0)
+
+#endif
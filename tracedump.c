@@ -0,0 +1,133 @@
+/************************************************************************
+ * Decode a trace written with STCP_TRACE set, one line per record in
+ * time order, with times in seconds since the trace started:
+ *
+ *     tracedump file
+ *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tcp.h"
+#include "trace.h"
+
+#define MAX_CHANNELS 64
+
+static char *channelNames[MAX_CHANNELS];
+static traceRecord *records;
+
+/* Order record indexes by time, keeping the file's order for equal times */
+static int byTime(const void *a, const void *b) {
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+
+    if (records[x].time != records[y].time) return records[x].time < records[y].time ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Split the names that follow a TRACE_CHANNELS record into channelNames.
+ */
+static void readNames(char *names, int len) {
+    int channel = 0;
+
+    names[len] = '\0';
+    for (char *name = strtok(names, "\n"); name && channel < MAX_CHANNELS; name = strtok(NULL, "\n")) {
+        channelNames[channel++] = name;
+    }
+}
+
+static void printRecord(traceRecord *rec, uint64_t start) {
+    uint64_t t = rec->time - start;
+    char channel[16];
+    const char *name = rec->channel < MAX_CHANNELS ? channelNames[rec->channel] : NULL;
+
+    if (name == NULL) {
+        snprintf(channel, sizeof(channel), "%u", rec->channel);
+        name = channel;
+    }
+    printf("%4llu.%09llu [%u] ", (unsigned long long) (t / 1000000000),
+           (unsigned long long) (t % 1000000000), rec->thread);
+
+    switch (rec->event) {
+    case TRACE_SENT:
+    case TRACE_RECEIVED:
+        printf("(%s) %c %s%s%s%sseq %u ack %u win %u payload %u bytes\n", name, rec->event,
+               rec->flags & SYN ? "SYN " : "", rec->flags & ACK ? "ACK " : "",
+               rec->flags & FIN ? "FIN " : "", rec->flags & RST ? "RST " : "",
+               rec->seq, rec->ack, rec->window, rec->len);
+        break;
+    case TRACE_RETRANSMIT:
+        printf("(%s) retransmit %u, %u bytes, window start %u, cwnd %u\n", name,
+               rec->seq, rec->len, rec->ack, rec->window);
+        break;
+    case TRACE_TIMEOUT:
+        printf("(%s) timeout %u after %u ms, window start %u, cwnd %u\n", name,
+               rec->seq, rec->len, rec->ack, rec->window);
+        break;
+    case TRACE_LOST:
+        printf("%u records lost to a full ring\n", rec->len);
+        break;
+    default:
+        printf("(%s) event %d seq %u ack %u len %u window %u\n", name, rec->event,
+               rec->seq, rec->ack, rec->len, rec->window);
+        break;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: tracedump file\n");
+        exit(1);
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror(argv[1]);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    char *data = malloc(size + 1);
+    if (data == NULL || fread(data, 1, size, f) != (size_t) size) {
+        perror(argv[1]);
+        exit(1);
+    }
+    fclose(f);
+
+    records = (traceRecord *) data;
+    long count = size / sizeof(traceRecord);
+    if (count == 0 || records[0].event != TRACE_START || records[0].seq != TRACE_MAGIC ||
+        records[0].len != sizeof(traceRecord)) {
+        fprintf(stderr, "%s is not an STCP trace\n", argv[1]);
+        exit(1);
+    }
+    if (records[0].ack != TRACE_VERSION) {
+        fprintf(stderr, "%s is a version %u trace, expected %d\n", argv[1], records[0].ack, TRACE_VERSION);
+        exit(1);
+    }
+
+    /* A trace that was never stopped has no names and may end mid-record */
+    for (long i = 1; i < count; i++) {
+        if (records[i].event != TRACE_CHANNELS) continue;
+        long names = (i + 1) * sizeof(traceRecord);
+        readNames(data + names, size - names < records[i].len ? size - names : records[i].len);
+        count = i;
+        break;
+    }
+
+    long *order = malloc(count * sizeof(long));
+    if (order == NULL) {
+        perror("tracedump");
+        exit(1);
+    }
+    for (long i = 1; i < count; i++) order[i - 1] = i;
+    qsort(order, count - 1, sizeof(long), byTime);
+    for (long i = 0; i < count - 1; i++) printRecord(&records[order[i]], records[0].time);
+    free(order);
+    free(data);
+    return 0;
+}